@@ -0,0 +1,396 @@
+#include "sm.hpp"
+
+#include <benchmark/benchmark.h>//Google Benchmark
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+using namespace sm;
+
+//=====allocation counting=====//
+//every form of new and delete is replaced, so each delete matches the new it frees
+//they're kept out of line, or GCC pairs the malloc and free inlined into callers and warns of a mismatch
+#ifdef __GNUC__
+	#define OUT_OF_LINE __attribute__((noinline))
+#else
+	#define OUT_OF_LINE
+#endif
+
+std::atomic<unsigned long> allocations(0);
+
+void* countedAllocate(std::size_t size) noexcept{
+	++allocations;
+	return std::malloc(size?size:1);
+}
+
+OUT_OF_LINE void* operator new(std::size_t size){
+	void* p=countedAllocate(size);
+	if(!p) throw std::bad_alloc();
+	return p;
+}
+
+OUT_OF_LINE void* operator new[](std::size_t size){ return operator new(size); }
+OUT_OF_LINE void* operator new(std::size_t size, const std::nothrow_t&) noexcept{ return countedAllocate(size); }
+OUT_OF_LINE void* operator new[](std::size_t size, const std::nothrow_t&) noexcept{ return countedAllocate(size); }
+OUT_OF_LINE void operator delete(void* p) noexcept{ std::free(p); }
+OUT_OF_LINE void operator delete[](void* p) noexcept{ std::free(p); }
+OUT_OF_LINE void operator delete(void* p, std::size_t) noexcept{ std::free(p); }
+OUT_OF_LINE void operator delete[](void* p, std::size_t) noexcept{ std::free(p); }
+OUT_OF_LINE void operator delete(void* p, const std::nothrow_t&) noexcept{ std::free(p); }
+OUT_OF_LINE void operator delete[](void* p, const std::nothrow_t&) noexcept{ std::free(p); }
+
+//=====data=====//
+std::string romFileName;
+Rom pristine;//as opened, or synthetic
+std::vector<U32> rooms;//offsets of rooms to benchmark
+bool synthetic=false;
+
+U16 toLoRom16(U32 offset){ return 0x8000u|(offset&0x7FFFu); }
+U32 toLoRom(U32 offset){ return 0x800000u|(offset&0x3F8000u)<<1|0x8000u|(offset&0x7FFFu); }
+U32 bankStart(U8 bank){ return (bank&0x7Fu)<<15; }
+U32 fromLoRom(U32 address){ return (address>>16&0x7Fu)<<15|(address&0x7FFFu); }
+
+void put16(Buffer& buffer, U32 offset, U16 value){
+	buffer[offset+0]=value>>0&0xFFu;
+	buffer[offset+1]=value>>8&0xFFu;
+}
+
+//something shaped like level data -- runs, repeats and noise
+void syntheticLevel(Buffer& level, unsigned w, unsigned h){
+	unsigned tiles=w*h;
+	level.assign(2+5*tiles, 0);
+	put16(level, 0, 2*tiles);
+	unsigned seed=12345;
+	for(unsigned i=0; i<tiles; ++i){
+		seed=seed*1103515245u+12345u;
+		U16 tile=(i/w)%4==0?0x8100u|(seed>>16&0x1Fu):0x00FFu;//solid rows between air
+		if(i==w*h/2) tile=0x9000u;//door, bts 0
+		put16(level, 2+2*i, tile);
+		level[2+2*tiles+i]=i==w*h/2?0:seed>>24&3;
+		put16(level, 2+3*tiles+2*i, 0x0338u|(i%w&7));
+	}
+}
+
+//one room with a door, enemies, post load modifications and scroll data, plus free space to save to
+void syntheticRom(Rom& rom){
+	Buffer& b=rom.buffer;
+	b.assign(0x300000u, 0);
+	const unsigned W=4, H=2;
+	const U32 header=bankStart(0x8Fu)+0x100u, doors=header+0x300u, scroll=header+0x400u, plm=header+0x500u;
+	const U32 enemies=bankStart(0xA1u)+0x100u, transition=bankStart(0x83u)+0x100u, tiles=bankStart(0xC2u);
+	//header
+	b[header+4]=W;
+	b[header+5]=H;
+	b[header+6]=0x70u;
+	b[header+7]=0xA0u;
+	put16(b, header+9, toLoRom16(doors));
+	put16(b, header+11, Header::STANDARD);
+	//state
+	U32 state=header+13;
+	U32 tilesPointer=toLoRom(tiles);
+	b[state+0]=tilesPointer;
+	b[state+1]=tilesPointer>>8;
+	b[state+2]=tilesPointer>>16;
+	put16(b, state+8, toLoRom16(enemies));
+	put16(b, state+14, toLoRom16(scroll));
+	put16(b, state+20, toLoRom16(plm));
+	//level data
+	Buffer level, compressed;
+	syntheticLevel(level, W*SCREEN_SIZE, H*SCREEN_SIZE);
+	compress(level, compressed);
+	for(unsigned i=0; i<compressed.size(); ++i) b[tiles+i]=compressed[i];
+	//doors
+	put16(b, doors, toLoRom16(transition));
+	put16(b, transition, toLoRom16(header));
+	put16(b, transition+8, 0x8000u);
+	//scroll
+	for(unsigned i=0; i<W*H; ++i) b[scroll+i]=1;
+	//enemies
+	for(unsigned i=0; i<4; ++i){
+		put16(b, enemies+i*Enemy::SIZE, 0xCEBFu);
+		put16(b, enemies+i*Enemy::SIZE+2, 0x40u*i);
+	}
+	put16(b, enemies+4*Enemy::SIZE, Enemy::SENTINEL);
+	//post load modifications
+	for(unsigned i=0; i<4; ++i){
+		put16(b, plm+i*Plm::SIZE, 0xEED7u);
+		b[plm+i*Plm::SIZE+2]=i;
+	}
+	//free space
+	rom.freeSpace(bankStart(0x8Fu)+0x1000u, 0x7000u);
+	rom.freeSpace(bankStart(0xA1u)+0x1000u, 0x7000u);
+	for(U8 bank=Tile::FIRST_BANK+1; bank<=Tile::LAST_BANK; ++bank) rom.freeSpace(bankStart(bank), 0x8000u);
+}
+
+//=====benchmarks=====//
+void BM_RomOpen(benchmark::State& state){
+	std::string fileName=romFileName;
+	if(synthetic){
+		fileName="bench_synthetic.smc";
+		pristine.save(fileName);
+	}
+	Rom rom;
+	for(auto _: state){
+		std::string error=rom.open(fileName);
+		if(error!="") state.SkipWithError(error.c_str());
+	}
+	state.SetBytesProcessed(state.iterations()*rom.buffer.size());
+	if(synthetic) std::remove(fileName.c_str());
+}
+
+void BM_RomIndexVanilla(benchmark::State& state){
+	if(synthetic){
+		state.SkipWithError("needs a ROM");
+		return;
+	}
+	Rom rom;
+	for(auto _: state){
+		state.PauseTiming();
+		rom=pristine;
+		state.ResumeTiming();
+		if(!rom.indexVanilla()) state.SkipWithError("indexVanilla failed");
+	}
+	state.SetItemsProcessed(state.iterations()*VANILLA_ROOMS);
+}
+
+//offsets of every state's level data
+std::vector<U32> levelOffsets(){
+	std::vector<U32> result;
+	for(unsigned i=0; i<rooms.size(); ++i){
+		Header header(pristine.buffer, rooms[i]);
+		for(unsigned j=0; j<header.stateInfo.size(); ++j){
+			U32 tiles=State(pristine.buffer, header.stateInfo[j].state).tiles;
+			bool seen=false;
+			for(unsigned k=0; k<result.size(); ++k) seen|=result[k]==tiles;
+			if(!seen) result.push_back(tiles);
+		}
+	}
+	return result;
+}
+
+void BM_Decompress(benchmark::State& state){
+	std::vector<U32> offsets=levelOffsets();
+	Buffer destination;
+	unsigned long bytes=0;
+	for(auto _: state)
+		for(unsigned i=0; i<offsets.size(); ++i){
+			destination.clear();
+			decompress(pristine.buffer, offsets[i], &destination);
+			bytes+=destination.size();
+		}
+	state.SetBytesProcessed(bytes);
+	state.SetItemsProcessed(state.iterations()*offsets.size());
+}
+
+void BM_Compress(benchmark::State& state){
+	std::vector<U32> offsets=levelOffsets();
+	std::vector<Buffer> sources(offsets.size());
+	for(unsigned i=0; i<offsets.size(); ++i) decompress(pristine.buffer, offsets[i], &sources[i]);
+	Buffer destination;
+	unsigned long bytes=0;
+	for(auto _: state)
+		for(unsigned i=0; i<sources.size(); ++i){
+			destination.clear();
+			compress(sources[i], destination);
+			bytes+=sources[i].size();
+		}
+	state.SetBytesProcessed(bytes);
+	state.SetItemsProcessed(state.iterations()*sources.size());
+}
+
+void BM_RoomOpen(benchmark::State& state){
+	Rom rom=pristine;
+	Room room(rom);
+	for(unsigned i=0; i<rooms.size(); ++i) room.open(rooms[i]);//warm up so reused memory is in place
+	unsigned long before=allocations;
+	for(auto _: state)
+		for(unsigned i=0; i<rooms.size(); ++i)
+			if(!room.open(rooms[i])) state.SkipWithError("Room::open failed");
+	state.SetItemsProcessed(state.iterations()*rooms.size());
+	state.counters["allocs/room"]=1.0*(allocations-before)/(state.iterations()*rooms.size());
+}
+
+void BM_RoomSave(benchmark::State& state){
+	Rom prepared=pristine, rom;
+	if(!synthetic) prepared.indexVanilla();
+	rom=prepared;
+	std::vector<Room> opened(rooms.size(), Room(rom));
+	for(auto _: state){
+		//each iteration is a first save, from a fresh rom with rooms opened from it
+		state.PauseTiming();
+		rom=prepared;
+		for(unsigned i=0; i<opened.size(); ++i) opened[i].open(rooms[i]);
+		state.ResumeTiming();
+		for(unsigned i=0; i<opened.size(); ++i){
+			U32 offset;
+			if(!opened[i].save(offset)) state.SkipWithError("Room::save failed");
+		}
+	}
+	state.SetItemsProcessed(state.iterations()*rooms.size());
+}
+
+void BM_RoomLoadGraphics(benchmark::State& state){
+	if(synthetic){
+		state.SkipWithError("needs a ROM");
+		return;
+	}
+	Rom rom=pristine;
+	Room room(rom);
+	for(auto _: state)
+		for(unsigned i=0; i<rooms.size(); ++i){
+			state.PauseTiming();
+			room.open(rooms[i]);
+			state.ResumeTiming();
+			room.loadGraphics();
+		}
+	state.SetItemsProcessed(state.iterations()*rooms.size());
+}
+
+const unsigned TILES_WIDE=32;
+
+void BM_DrawTileSet(benchmark::State& state){
+	if(synthetic){
+		state.SkipWithError("needs a ROM");
+		return;
+	}
+	Rom rom=pristine;
+	Room room(rom);
+	Array2D<Color> destination;
+	unsigned long bytes=0;
+	for(auto _: state)
+		for(unsigned i=0; i<rooms.size(); ++i){
+			state.PauseTiming();
+			room.open(rooms[i]);
+			room.loadGraphics();
+			state.ResumeTiming();
+			room.drawTileSet(destination, TILES_WIDE);
+			bytes+=destination.size()*sizeof(Color);
+		}
+	state.SetBytesProcessed(bytes);
+	state.SetItemsProcessed(state.iterations()*rooms.size());
+}
+
+struct TileSetSource{
+	Buffer subtiles;
+	std::vector<TileAssembler> assemblers;
+};
+
+//the subtiles and tile table of every vanilla tile set but mode 7's, or one random tile set on the synthetic rom
+std::vector<TileSetSource> tileSetSources(){
+	std::vector<TileSetSource> result;
+	const U32 TILE_SETS=0x7E6A2u;
+	unsigned seed=12345;
+	for(unsigned t=0; t<(synthetic?1:29); ++t){
+		if(!synthetic&&Mode7::FIRST_TILE_SET<=t&&t<=Mode7::LAST_TILE_SET) continue;
+		Buffer graphics(0x8000u), table;
+		if(synthetic){
+			table.resize(0x2000u);
+			for(unsigned i=0; i<graphics.size(); ++i) graphics[i]=(seed=seed*1103515245u+12345u)>>16;
+			for(unsigned i=0; i<table.size(); ++i) table[i]=(seed=seed*1103515245u+12345u)>>16;
+		}
+		else{
+			View tileSet(pristine.buffer, TILE_SETS+9*t);
+			graphics.clear();
+			decompress(pristine.buffer, fromLoRom(tileSet.readU24(3)), &graphics);
+			graphics.resize(0x8000u);//common room elements would follow
+			decompress(pristine.buffer, fromLoRom(tileSet.readU24(0)), &table);
+		}
+		result.push_back(TileSetSource());
+		decodeSubtiles(graphics, result.back().subtiles);
+		for(unsigned i=0; i+8<=table.size(); i+=8)
+			result.back().assemblers.push_back(TileAssembler(
+				table[i+1]<<8|table[i+0], table[i+3]<<8|table[i+2], table[i+5]<<8|table[i+4], table[i+7]<<8|table[i+6]
+			));
+	}
+	return result;
+}
+
+//arg 0 for the specialized kernels loadGraphics uses, 1 for the generic per-pixel path
+void BM_AssembleTiles(benchmark::State& state){
+	std::vector<TileSetSource> sources=tileSetSources();
+	std::vector<Array2D<U8> > tiles;
+	unsigned long assembled=0;
+	for(auto _: state)
+		for(unsigned i=0; i<sources.size(); ++i){
+			assembleTiles(sources[i].subtiles, sources[i].assemblers, tiles, state.range(0)!=0);
+			assembled+=tiles.size();
+		}
+	state.SetBytesProcessed(assembled*TILE_SIZE*TILE_SIZE);
+	state.SetItemsProcessed(assembled);
+}
+
+void BM_GetQuadsVertexArray(benchmark::State& state){
+	Rom rom=pristine;
+	Room room(rom);
+	std::vector<Vertex> vertices;
+	unsigned long bytes=0;
+	for(auto _: state)
+		for(unsigned i=0; i<rooms.size(); ++i){
+			state.PauseTiming();
+			room.open(rooms[i]);
+			if(!synthetic) room.loadGraphics();
+			vertices.clear();
+			state.ResumeTiming();
+			room.getQuadsVertexArray(vertices, TILES_WIDE);
+			bytes+=vertices.size()*sizeof(Vertex);
+		}
+	state.SetBytesProcessed(bytes);
+	state.SetItemsProcessed(state.iterations()*rooms.size());
+}
+
+//holes too small to use in every level data bank, so takeSpace has to scan to the one big hole at the end
+void BM_TakeSpaceFragmented(benchmark::State& state){
+	Rom rom;
+	rom.buffer.assign(0x300000u, 0);
+	for(U8 bank=Tile::FIRST_BANK; bank<=Tile::LAST_BANK; ++bank)
+		for(U32 offset=bankStart(bank); offset<bankStart(bank)+0x8000u; offset+=32)
+			rom.freeSpace(offset, 24);
+	const U16 SIZE=0x400u;
+	rom.freeSpace(bankStart(Tile::LAST_BANK)+0x6000u, 0x2000u);
+	unsigned long bytes=0;
+	for(auto _: state){
+		U32 offset;
+		if(!rom.takeSpace(Tile::FIRST_BANK, Tile::LAST_BANK, SIZE, offset)) state.SkipWithError("takeSpace failed");
+		rom.freeSpace(offset, SIZE);
+		bytes+=offset+SIZE-bankStart(Tile::FIRST_BANK);
+	}
+	state.SetBytesProcessed(bytes);//bytes of index scanned
+	state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_RomOpen)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_RomIndexVanilla)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Decompress)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Compress)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_RoomOpen)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_RoomSave)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_RoomLoadGraphics)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_DrawTileSet)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_AssembleTiles)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_GetQuadsVertexArray)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_TakeSpaceFragmented)->Unit(benchmark::kMicrosecond);
+
+//usage: bench [benchmark flags] [rom file] -- without a rom file, a synthetic rom is used
+int main(int argc, char** argv){
+	benchmark::Initialize(&argc, argv);
+	if(argc>1){
+		romFileName=argv[1];
+		std::string error=pristine.open(romFileName);
+		if(error!=""){
+			std::fprintf(stderr, "%s: %s\n", romFileName.c_str(), error.c_str());
+			return -1;
+		}
+		rooms.assign(VANILLA_ROOM_OFFSETS, VANILLA_ROOM_OFFSETS+VANILLA_ROOMS);
+	}
+	else{
+		synthetic=true;
+		syntheticRom(pristine);
+		rooms.push_back(bankStart(0x8Fu)+0x100u);
+		benchmark::AddCustomContext("rom", "synthetic");
+	}
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
@@ -0,0 +1,82 @@
+#include "sm.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+using namespace sm;
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start){
+	return std::chrono::duration<double>(Clock::now()-start).count();
+}
+
+//every room in the bundle opens from the rom and matches it: its doors, and every state's tiles, enemies and plm
+unsigned verify(const Rom& rom, const BundleView& bundle){
+	unsigned failures=0;
+	Room room(rom);
+	for(unsigned r=0; r<bundle.readRooms(); ++r){
+		BundleRoomView bundled=bundle.readRoom(r);
+		bool matches=room.open(bundled.readHeaderOffset())&&bundled.readStates()==room.readStates()&&bundled.readDoors()==room.readDoors().size();
+		for(unsigned i=0; matches&&i<room.readDoors().size(); ++i) matches&=bundled.readDoor(i)==room.readDoors()[i];
+		for(unsigned s=0; matches&&s<room.readStates(); ++s){
+			room.setState(s);
+			BundleStateView state=bundled.readState(s);
+			for(unsigned i=0; i<state.readTilesWide(); ++i)
+				for(unsigned j=0; j<state.readTilesHigh(); ++j)
+					matches&=same(state.readTile(i, j), room.readTile(i, j));
+			const std::vector<Enemy>& enemies=room.readEnemies();
+			matches&=state.readEnemies()==enemies.size();
+			EnemyView enemy=state.readFirstEnemy();
+			for(unsigned i=0; matches&&i<enemies.size(); ++i, enemy=enemy.next()) matches&=same(Enemy(enemy), enemies[i]);
+			const std::vector<Plm>& plms=room.readPlm();
+			matches&=state.readPlms()==plms.size();
+			PlmView plm=state.readFirstPlm();
+			for(unsigned i=0; matches&&i<plms.size(); ++i, plm=plm.next()) matches&=same(Plm(plm), plms[i]);
+		}
+		if(!matches){
+			std::cout<<"room "<<r<<" at 0x"<<std::hex<<bundled.readHeaderOffset()<<std::dec<<" doesn't match the rom\n";
+			++failures;
+		}
+	}
+	return failures;
+}
+
+//usage: bundle rom output
+//writes every vanilla room decoded into a bundle, see sm::Bundle for the format
+int main(int argc, char** argv){
+	if(argc<3){
+		std::cout<<"usage: bundle rom output\n";
+		return -1;
+	}
+	Rom rom;
+	std::string error=rom.open(argv[1]);
+	if(error!=""){
+		std::cout<<argv[1]<<": "<<error<<"\n";
+		return -1;
+	}
+	Buffer bundle;
+	Clock::time_point start=Clock::now();
+	if(!Bundle::write(rom, bundle)){
+		std::cout<<"couldn't open every room\n";
+		return -1;
+	}
+	double seconds=secondsSince(start);
+	std::ofstream out(argv[2], std::ios::binary);
+	out.write((const char*)&bundle[0], bundle.size());
+	out.close();
+	if(!out){
+		std::cout<<"couldn't write "<<argv[2]<<"\n";
+		return -1;
+	}
+	std::cout<<"rooms: "<<rom.rooms.size()<<", bytes: "<<bundle.size()<<", seconds: "<<seconds<<"\n";
+	BundleView view(bundle);
+	if(!view.check()){
+		std::cout<<"bundle doesn't check\n";
+		return 1;
+	}
+	unsigned failures=verify(rom, view);
+	if(failures) std::cout<<failures<<" rooms don't match\n";
+	return failures?1:0;
+}
@@ -0,0 +1,111 @@
+#include "sm.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+
+using namespace sm;
+
+typedef std::chrono::steady_clock Clock;
+
+U8 bankOf(U32 offset){ return 0x80u|offset>>15; }
+
+struct Totals{
+	Totals(): assets(0), original(0), recompressed(0), decompressed(0), seconds(0.0) {}
+	void add(unsigned originalSize, unsigned recompressedSize, unsigned decompressedSize, double time){
+		++assets;
+		original+=originalSize;
+		recompressed+=recompressedSize;
+		decompressed+=decompressedSize;
+		seconds+=time;
+	}
+	void add(const Totals& other){
+		assets+=other.assets;
+		original+=other.original;
+		recompressed+=other.recompressed;
+		decompressed+=other.decompressed;
+		seconds+=other.seconds;
+	}
+	void print(const std::string& name) const{
+		std::printf(
+			"%-18s %6u %9lu %9lu %9ld %8.2f%% %12lu %10.4f\n",
+			name.c_str(), assets, original, recompressed, long(original)-long(recompressed),
+			original?100.0*recompressed/original:0.0, decompressed, seconds
+		);
+	}
+	unsigned assets;
+	unsigned long original, recompressed, decompressed;
+	double seconds;
+};
+
+void printTotalsHeader(const std::string& by){
+	std::printf("%-18s %6s %9s %9s %9s %9s %12s %10s\n", by.c_str(), "assets", "original", "ours", "saved", "ratio", "decompressed", "seconds");
+}
+
+//usage: compression rom [-v]
+//recompresses every compressed asset the library knows about with compress, reporting sizes and time by bank and by kind
+int main(int argc, char** argv){
+	if(argc<2){
+		std::cout<<"usage: compression rom [-v]\n";
+		return -1;
+	}
+	bool verbose=argc>2&&std::string(argv[2])=="-v";
+	Rom rom;
+	std::string error=rom.open(argv[1]);
+	if(error!=""){
+		std::cout<<argv[1]<<": "<<error<<"\n";
+		return -1;
+	}
+	std::vector<Compressed> assets;
+	rom.findCompressed(assets);
+	std::map<U8, Totals> banks;
+	std::map<Compressed::Kind, Totals> kinds;
+	Totals total;
+	Buffer decompressed, recompressed;
+	unsigned failures=0;
+	if(verbose) std::printf("%-18s %8s %9s %9s %12s %10s\n", "kind", "address", "original", "ours", "decompressed", "seconds");
+	for(unsigned i=0; i<assets.size(); ++i){
+		decompressed.clear();
+		unsigned original=decompress(rom.buffer, assets[i].offset, &decompressed);
+		recompressed.clear();
+		Clock::time_point start=Clock::now();
+		compress(decompressed, recompressed);
+		double seconds=std::chrono::duration<double>(Clock::now()-start).count();
+		if(verbose) std::printf(
+			"%-18s %02X:%04X %9u %9u %12u %10.4f\n",
+			Compressed::kindDescription(assets[i].kind).c_str(),
+			bankOf(assets[i].offset), 0x8000u|(assets[i].offset&0x7FFFu),
+			original, unsigned(recompressed.size()), unsigned(decompressed.size()), seconds
+		);
+		Buffer roundTrip;
+		decompress(recompressed, 0, &roundTrip);
+		if(roundTrip!=decompressed){
+			std::printf("%02X:%04X doesn't survive recompression\n", bankOf(assets[i].offset), 0x8000u|(assets[i].offset&0x7FFFu));
+			++failures;
+		}
+		banks[bankOf(assets[i].offset)].add(original, recompressed.size(), decompressed.size(), seconds);
+		kinds[assets[i].kind].add(original, recompressed.size(), decompressed.size(), seconds);
+		total.add(original, recompressed.size(), decompressed.size(), seconds);
+	}
+	std::printf("\n");
+	printTotalsHeader("bank");
+	Totals levelBanks;
+	for(std::map<U8, Totals>::iterator i=banks.begin(); i!=banks.end(); ++i){
+		char name[8];
+		std::sprintf(name, "%02X", i->first);
+		i->second.print(name);
+		if(Tile::FIRST_BANK<=i->first&&i->first<=Tile::LAST_BANK) levelBanks.add(i->second);
+	}
+	std::printf("\n");
+	printTotalsHeader("kind");
+	for(std::map<Compressed::Kind, Totals>::iterator i=kinds.begin(); i!=kinds.end(); ++i)
+		i->second.print(Compressed::kindDescription(i->first));
+	std::printf("\n");
+	char levelBanksName[16];
+	std::sprintf(levelBanksName, "banks %02X-%02X", Tile::FIRST_BANK, Tile::LAST_BANK);
+	levelBanks.print(levelBanksName);
+	total.print("total");
+	if(failures) std::printf("%u assets don't survive recompression\n", failures);
+	return failures?1:0;
+}
@@ -0,0 +1,67 @@
+#include "sm.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+using namespace sm;
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start){
+	return std::chrono::duration<double>(Clock::now()-start).count();
+}
+
+void printPair(const Rom& a, const Rom& b, const RomDiff::Pair& pair){
+	if(pair.a==RoomRegistry::NONE){
+		std::printf("only in b: room %u at %06X\n", pair.b, b.rooms.readOffset(pair.b));
+		return;
+	}
+	if(pair.b==RoomRegistry::NONE){
+		std::printf("only in a: room %u at %06X\n", pair.a, a.rooms.readOffset(pair.a));
+		return;
+	}
+	const Room::Differences& d=pair.differences;
+	std::printf(
+		"room %u at %06X, %06X%s:%s states %u, tiles %u, bts %u, enemies %u, plm %u, doors %u, scroll %u\n",
+		pair.a, a.rooms.readOffset(pair.a), b.rooms.readOffset(pair.b), pair.byDoors?" (by doors)":"",
+		d.header?" header,":"", d.states, d.tiles, d.bts, d.enemies, d.plm, d.doors, d.scroll
+	);
+}
+
+//usage: romdiff rom rom [-v]
+//pairs the rooms of two roms and reports how each pair differs, -v also lists pairs that match
+int main(int argc, char** argv){
+	if(argc<3){
+		std::cout<<"usage: romdiff rom rom [-v]\n";
+		return -1;
+	}
+	bool verbose=argc>3&&std::strcmp(argv[3], "-v")==0;
+	Rom roms[2];
+	for(unsigned i=0; i<2; ++i){
+		std::string error=roms[i].open(argv[1+i]);
+		if(error!=""){
+			std::cout<<argv[1+i]<<": "<<error<<"\n";
+			return -1;
+		}
+	}
+	Clock::time_point start=Clock::now();
+	RomDiff diff;
+	if(!diff.build(roms[0], roms[1])){
+		std::cout<<"couldn't open every room\n";
+		return -1;
+	}
+	double seconds=secondsSince(start);
+	unsigned differing=0, unpaired=0, decoded=0;
+	const std::vector<RomDiff::Pair>& pairs=diff.readPairs();
+	for(unsigned i=0; i<pairs.size(); ++i){
+		const RomDiff::Pair& pair=pairs[i];
+		if(pair.a==RoomRegistry::NONE||pair.b==RoomRegistry::NONE) ++unpaired;
+		else if(!pair.readSame()) ++differing;
+		if(pair.a!=RoomRegistry::NONE&&pair.b!=RoomRegistry::NONE&&!pair.bytesSame) ++decoded;
+		if(verbose||!pair.readSame()) printPair(roms[0], roms[1], pair);
+	}
+	std::cout<<"pairs: "<<pairs.size()-unpaired<<", differing: "<<differing<<", unpaired: "<<unpaired<<", decoded: "<<decoded<<", seconds: "<<seconds<<"\n";
+	return differing||unpaired?1:0;
+}
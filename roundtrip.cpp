@@ -0,0 +1,212 @@
+#include "sm.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace sm;
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start){
+	return std::chrono::duration<double>(Clock::now()-start).count();
+}
+
+//offsets of every vanilla state's level data, each once
+std::vector<U32> levelOffsets(const Rom& rom){
+	std::vector<U32> result;
+	for(unsigned i=0; i<VANILLA_ROOMS; ++i){
+		Header header(rom.buffer, VANILLA_ROOM_OFFSETS[i]);
+		for(unsigned j=0; j<header.stateInfo.size(); ++j){
+			U32 tiles=State(rom.buffer, header.stateInfo[j].state).tiles;
+			if(std::find(result.begin(), result.end(), tiles)==result.end()) result.push_back(tiles);
+		}
+	}
+	return result;
+}
+
+struct Results{
+	Results(): failures(0), vanillaBytes(0), compressedBytes(0), compressSeconds(0.0), openSeconds(0.0), saveSeconds(0.0) {}
+	unsigned failures;
+	unsigned long vanillaBytes, compressedBytes;//level data, as on the vanilla rom and as compressed by compress
+	double compressSeconds, openSeconds, saveSeconds;
+};
+
+//decompress(compress(x))==x for all level data
+void checkCompression(const Rom& rom, Results& results){
+	std::vector<U32> offsets=levelOffsets(rom);
+	Buffer level, compressed, roundTrip;
+	for(unsigned i=0; i<offsets.size(); ++i){
+		level.clear();
+		results.vanillaBytes+=decompress(rom.buffer, offsets[i], &level);
+		compressed.clear();
+		Clock::time_point start=Clock::now();
+		compress(level, compressed);
+		results.compressSeconds+=secondsSince(start);
+		results.compressedBytes+=compressed.size();
+		roundTrip.clear();
+		unsigned read=decompress(compressed, 0, &roundTrip);
+		if(roundTrip!=level||read!=compressed.size()){
+			std::cout<<"level data at 0x"<<std::hex<<offsets[i]<<std::dec<<": decompress(compress(x))!=x\n";
+			++results.failures;
+		}
+	}
+}
+
+//open -> save -> reopen gives the same room for every vanilla room, each saved into a fresh copy of the rom
+void checkRooms(const Rom& indexed, Results& results){
+	Rom rom;
+	for(unsigned i=0; i<VANILLA_ROOMS; ++i){
+		rom=indexed;
+		Room original(rom), reopened(rom);
+		std::stringstream ss;
+		ss<<"room at 0x"<<std::hex<<VANILLA_ROOM_OFFSETS[i]<<std::dec<<": ";
+		Clock::time_point start=Clock::now();
+		if(!original.open(VANILLA_ROOM_OFFSETS[i])){
+			std::cout<<ss.str()<<"open failed\n";
+			++results.failures;
+			continue;
+		}
+		results.openSeconds+=secondsSince(start);
+		U32 offset;
+		start=Clock::now();
+		if(!original.save(offset)){
+			std::cout<<ss.str()<<"save failed\n";
+			++results.failures;
+			continue;
+		}
+		results.saveSeconds+=secondsSince(start);
+		if(!reopened.open(offset)){
+			std::cout<<ss.str()<<"reopen failed\n";
+			++results.failures;
+			continue;
+		}
+		std::string difference=original.compare(reopened);
+		if(difference!=""){
+			std::cout<<ss.str()<<difference<<"\n";
+			++results.failures;
+		}
+	}
+}
+
+//rooms edited with RoomEdits are what their doors and saves lead to, and building a DoorGraph finds no rooms twice
+//every vanilla room is saved, as the indexed rom counts all room data as free, and those with enemies get their default state's first enemy moved
+void checkEdits(const Rom& indexed, Results& results){
+	Rom unedited=indexed, rom=indexed;
+	DoorGraph graph;
+	if(!graph.build(unedited)){
+		std::cout<<"couldn't build door graph\n";
+		++results.failures;
+		return;
+	}
+	RoomEdits edits(rom);
+	Room room(rom);
+	std::vector<int> expected(rom.rooms.size(), -1);//edited enemy x by room index
+	std::vector<U32> expectedDoors(rom.rooms.size(), 0);//first door by room index, 0 if not edited
+	for(unsigned i=0; i<VANILLA_ROOMS; ++i){
+		if(!room.open(VANILLA_ROOM_OFFSETS[i])) continue;
+		if(room.readDoors().size()){
+			edits.setDoor(VANILLA_ROOM_OFFSETS[i], 0, room.readDoors()[0]);//unchanged, just so the room is saved
+			expectedDoors[rom.rooms.find(VANILLA_ROOM_OFFSETS[i])]=room.readDoors()[0];
+		}
+		if(room.readEnemies().empty()) continue;
+		Enemy enemy=room.readEnemies()[0];
+		enemy.x^=1;
+		edits.setEnemy(VANILLA_ROOM_OFFSETS[i], room.readStates()-1, 0, enemy);
+		expected[rom.rooms.find(VANILLA_ROOM_OFFSETS[i])]=enemy.x;
+	}
+	std::vector<U32> failed;
+	if(!edits.apply(&failed)){
+		std::cout<<failed.size()<<" rooms failed to save edits\n";
+		results.failures+=failed.size();
+		return;
+	}
+	//every edited room
+	for(unsigned i=0; i<VANILLA_ROOMS; ++i){
+		U16 index=rom.rooms.find(VANILLA_ROOM_OFFSETS[i]);
+		if(expected[index]<0&&!expectedDoors[index]) continue;
+		bool same=room.open(VANILLA_ROOM_OFFSETS[i]);
+		if(same&&expectedDoors[index]) same=room.readDoors().size()&&room.readDoors()[0]==expectedDoors[index];
+		if(same&&expected[index]>=0){
+			room.setState(room.readStates()-1);
+			same=room.readEnemies().size()&&room.readEnemies()[0].x==expected[index];
+		}
+		if(!same){
+			std::cout<<"room at 0x"<<std::hex<<VANILLA_ROOM_OFFSETS[i]<<std::dec<<": doesn't reopen with its edits\n";
+			++results.failures;
+		}
+	}
+	//destinations of doors and saves
+	std::vector<U32> destinations;
+	for(unsigned e=0; e<graph.readEdges(); ++e) destinations.push_back(TransitionView(rom.buffer, graph.readEdge(e).transition).readRoom());
+	for(SaveView s(rom.buffer, Save::START); !s.atEnd(); s=s.next()) destinations.push_back(s.readRoom());
+	for(unsigned i=0; i<destinations.size(); ++i){
+		U16 index=rom.rooms.find(destinations[i]);
+		if(index==RoomRegistry::NONE||expected[index]<0) continue;
+		room.open(destinations[i]);
+		room.setState(room.readStates()-1);
+		if(room.readEnemies().empty()||room.readEnemies()[0].x!=expected[index]){
+			std::cout<<"room at 0x"<<std::hex<<destinations[i]<<std::dec<<": edit not seen through its door or save\n";
+			++results.failures;
+		}
+	}
+	DoorGraph edited;
+	if(!edited.build(rom)){
+		std::cout<<"couldn't build door graph of edited rom\n";
+		++results.failures;
+	}
+	else if(rom.rooms.size()!=unedited.rooms.size()){
+		std::cout<<"edited rom has "<<rom.rooms.size()<<" rooms, unedited has "<<unedited.rooms.size()<<"\n";
+		++results.failures;
+	}
+}
+
+//usage: roundtrip rom [history file]
+//each run appends a line of "seconds compressedBytes" to the history file, and fails if compressedBytes grew since the last line
+int main(int argc, char** argv){
+	if(argc<2){
+		std::cout<<"usage: roundtrip rom [history file]\n";
+		return -1;
+	}
+	Rom rom;
+	std::string error=rom.open(argv[1]);
+	if(error!=""){
+		std::cout<<argv[1]<<": "<<error<<"\n";
+		return -1;
+	}
+	if(!rom.indexVanilla()){
+		std::cout<<"couldn't index vanilla rom\n";
+		return -1;
+	}
+	Results results;
+	Clock::time_point start=Clock::now();
+	checkCompression(rom, results);
+	checkRooms(rom, results);
+	checkEdits(rom, results);
+	double seconds=secondsSince(start);
+	std::cout<<"rooms: "<<VANILLA_ROOMS<<", failures: "<<results.failures<<"\n";
+	std::cout<<"level data: "<<results.vanillaBytes<<" bytes vanilla, "<<results.compressedBytes<<" bytes compressed\n";
+	std::cout<<"seconds: "<<seconds<<" total, "<<results.compressSeconds<<" compress, "<<results.openSeconds<<" open, "<<results.saveSeconds<<" save\n";
+	if(argc>2){
+		std::ifstream in(argv[2]);
+		std::string line, last;
+		while(std::getline(in, line)) if(line!="") last=line;
+		in.close();
+		std::stringstream ss(last);
+		double lastSeconds;
+		unsigned long lastCompressedBytes;
+		if(ss>>lastSeconds>>lastCompressedBytes){
+			std::cout<<"last run: "<<lastSeconds<<" seconds, "<<lastCompressedBytes<<" bytes compressed\n";
+			if(results.compressedBytes>lastCompressedBytes){
+				std::cout<<"compressed size regressed\n";
+				++results.failures;
+			}
+		}
+		if(!results.failures){
+			std::ofstream out(argv[2], std::ios::app);
+			out<<seconds<<" "<<results.compressedBytes<<"\n";
+		}
+	}
+	return results.failures?1:0;
+}
@@ -0,0 +1,382 @@
+#include "sm.hpp"
+
+#include "SFML/Network.hpp"//SFML 2.0 RC
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+using namespace sm;
+
+typedef std::chrono::steady_clock Clock;
+
+const unsigned TILES_WIDE=32;
+const unsigned TILE_PIXELS=256;//served tiles are TILE_PIXELS square
+const unsigned MAX_ZOOM=4;//at zoom z, each served pixel is 2^z room pixels across
+const unsigned MAX_REQUEST=4096;
+const unsigned LATENCIES=4096;//how many recent requests /stats covers
+
+//=====png=====//
+//written with stored deflate blocks, so there's nothing to depend on -- bigger than it could be, but fast to make
+
+U32 crcTable[256];
+
+void makeCrcTable(){
+	for(U32 i=0; i<256; ++i){
+		U32 c=i;
+		for(unsigned j=0; j<8; ++j) c=c&1?0xEDB88320u^c>>1:c>>1;
+		crcTable[i]=c;
+	}
+}
+
+U32 crc(const Buffer& buffer, unsigned start){
+	U32 c=0xFFFFFFFFu;
+	for(unsigned i=start; i<buffer.size(); ++i) c=crcTable[(c^buffer[i])&0xFFu]^c>>8;
+	return c^0xFFFFFFFFu;
+}
+
+void putU32(Buffer& buffer, U32 u){
+	buffer.push_back(u>>24);
+	buffer.push_back(u>>16&0xFFu);
+	buffer.push_back(u>> 8&0xFFu);
+	buffer.push_back(u    &0xFFu);
+}
+
+void putChunk(Buffer& png, const char* type, const Buffer& data){
+	putU32(png, data.size());
+	unsigned start=png.size();
+	png.insert(png.end(), type, type+4);
+	png.insert(png.end(), data.begin(), data.end());
+	putU32(png, crc(png, start));
+}
+
+//rgba is w*h*4 bytes, row by row
+void encodePng(const Buffer& rgba, unsigned w, unsigned h, Buffer& png){
+	png.clear();
+	const U8 signature[]={0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	png.insert(png.end(), signature, signature+sizeof(signature));
+	Buffer data;
+	putU32(data, w);
+	putU32(data, h);
+	data.push_back(8);//bit depth
+	data.push_back(6);//rgba
+	data.push_back(0);
+	data.push_back(0);
+	data.push_back(0);
+	putChunk(png, "IHDR", data);
+	//scanlines, each with filter type 0
+	Buffer raw;
+	raw.reserve((w*4+1)*h);
+	for(unsigned y=0; y<h; ++y){
+		raw.push_back(0);
+		raw.insert(raw.end(), rgba.begin()+y*w*4, rgba.begin()+(y+1)*w*4);
+	}
+	//zlib stream of stored blocks
+	data.clear();
+	data.push_back(0x78);
+	data.push_back(0x01);
+	U32 a=1, b=0;
+	for(unsigned i=0; i<raw.size(); ++i){
+		a=(a+raw[i])%65521u;
+		b=(b+a)%65521u;
+	}
+	for(unsigned i=0; i<raw.size(); i+=0xFFFFu){
+		unsigned size=std::min(raw.size()-i, size_t(0xFFFFu));
+		data.push_back(i+size==raw.size());//final block
+		data.push_back(size&0xFFu);
+		data.push_back(size>>8);
+		data.push_back(~size&0xFFu);
+		data.push_back(~size>>8&0xFFu);
+		data.insert(data.end(), raw.begin()+i, raw.begin()+i+size);
+	}
+	putU32(data, b<<16|a);
+	putChunk(png, "IDAT", data);
+	putChunk(png, "IEND", Buffer());
+}
+
+//=====decoded rooms=====//
+//everything rendering a tile needs, read only once made so threads can share it
+struct DecodedRoom{
+	DecodedRoom(const Rom& rom): room(rom) {}
+	Room room;
+	Array2D<U8> atlas;//drawIndexedTileSet
+	Array2D<U8> mode7;//Mode7::readBitmap, empty if the room has no mode 7
+	U8 palette[256][4];//rgba
+};
+
+//least recently used rooms are dropped once there are more than capacity
+class RoomCache{
+	public:
+		RoomCache(const Rom& rom, unsigned capacity): rom(rom), capacity(capacity), hits(0), misses(0) {}
+		//NULL if there's no such room or state
+		std::shared_ptr<const DecodedRoom> get(U16 index, unsigned state){
+			Key key(index, state);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				std::map<Key, Entry>::iterator i=entries.find(key);
+				if(i!=entries.end()){
+					++hits;
+					order.splice(order.begin(), order, i->second.used);
+					return i->second.room;
+				}
+				++misses;
+			}
+			//decoded without the lock so hits aren't held up, two threads missing the same room both decode it
+			std::shared_ptr<const DecodedRoom> room=decode(index, state);
+			if(!room) return room;
+			std::lock_guard<std::mutex> lock(mutex);
+			if(entries.count(key)) return entries[key].room;
+			order.push_front(key);
+			Entry& entry=entries[key];
+			entry.room=room;
+			entry.used=order.begin();
+			if(order.size()>capacity){
+				entries.erase(order.back());
+				order.pop_back();
+			}
+			return room;
+		}
+		void readStats(unsigned& rooms, unsigned long& hits, unsigned long& misses){
+			std::lock_guard<std::mutex> lock(mutex);
+			rooms=entries.size();
+			hits=this->hits;
+			misses=this->misses;
+		}
+	private:
+		typedef std::pair<U16, unsigned> Key;
+		struct Entry{
+			std::shared_ptr<const DecodedRoom> room;
+			std::list<Key>::iterator used;
+		};
+		std::shared_ptr<const DecodedRoom> decode(U16 index, unsigned state) const{
+			std::shared_ptr<DecodedRoom> decoded;
+			if(index>=rom.rooms.size()) return decoded;
+			decoded.reset(new DecodedRoom(rom));
+			Room& room=decoded->room;
+			if(!room.open(rom.rooms.readOffset(index))||state>=room.readStates()) return std::shared_ptr<const DecodedRoom>();
+			room.setState(state);
+			room.loadGraphics();
+			room.drawIndexedTileSet(decoded->atlas, TILES_WIDE);
+			if(room.readMode7().readTiles().size()) decoded->mode7=room.readMode7().readBitmap();
+			const std::vector<Color>& palette=room.readPalette();
+			for(unsigned i=0; i<256; ++i){
+				Color c=i<palette.size()?palette[i]:Color();
+				decoded->palette[i][0]=U8(c.r*255);
+				decoded->palette[i][1]=U8(c.g*255);
+				decoded->palette[i][2]=U8(c.b*255);
+				decoded->palette[i][3]=U8(c.a*255);
+			}
+			return decoded;
+		}
+		const Rom& rom;
+		unsigned capacity;
+		std::mutex mutex;
+		std::list<Key> order;//most recently used first
+		std::map<Key, Entry> entries;
+		unsigned long hits, misses;
+};
+
+//=====rendering=====//
+enum Layers{ LAYER1=1, LAYER2=2, MODE7=4 };
+
+//palette index of a layer's pixel, 0 if transparent
+U8 readLayerPixel(const DecodedRoom& decoded, const TileLayer& layer, unsigned x, unsigned y){
+	if(layer.flipH) x=TILE_SIZE-1-x;
+	if(layer.flipV) y=TILE_SIZE-1-y;
+	unsigned i=layer.index%TILES_WIDE*TILE_SIZE+x, j=layer.index/TILES_WIDE*TILE_SIZE+y;
+	if(i>=decoded.atlas.readISize()||j>=decoded.atlas.readJSize()) return 0;
+	return decoded.atlas.at(i, j);
+}
+
+//tile (x, y) of the room scaled down by 2^zoom, layer 1 over layer 2 over mode 7 like the viewer
+void renderTile(const DecodedRoom& decoded, unsigned layers, unsigned zoom, unsigned x, unsigned y, Buffer& rgba){
+	const Room& room=decoded.room;
+	rgba.assign(TILE_PIXELS*TILE_PIXELS*4, 0);
+	for(unsigned py=0; py<TILE_PIXELS; ++py)
+		for(unsigned px=0; px<TILE_PIXELS; ++px){
+			unsigned rx=(x*TILE_PIXELS+px)<<zoom, ry=(y*TILE_PIXELS+py)<<zoom;
+			if(rx>=room.readW()||ry>=room.readH()) continue;
+			const U8* color=NULL;
+			const Tile& tile=room.readTile(rx/TILE_SIZE, ry/TILE_SIZE);
+			U8 index;
+			if(layers&LAYER1&&(index=readLayerPixel(decoded, tile.layer1, rx%TILE_SIZE, ry%TILE_SIZE))) color=decoded.palette[index];
+			else if(layers&LAYER2&&tile.hasLayer2&&(index=readLayerPixel(decoded, tile.layer2, rx%TILE_SIZE, ry%TILE_SIZE))) color=decoded.palette[index];
+			else if(layers&MODE7&&rx<decoded.mode7.readISize()&&ry<decoded.mode7.readJSize()&&(index=decoded.mode7.at(rx, ry))) color=decoded.palette[index];
+			if(!color) continue;
+			std::copy(color, color+4, rgba.begin()+(py*TILE_PIXELS+px)*4);
+		}
+}
+
+//=====serving=====//
+class Latencies{
+	public:
+		Latencies(): next(0) {}
+		void add(double seconds){
+			std::lock_guard<std::mutex> lock(mutex);
+			if(recent.size()<LATENCIES) recent.push_back(seconds);
+			else recent[next]=seconds;
+			next=(next+1)%LATENCIES;
+		}
+		//fraction 0.99 for p99
+		double readPercentile(double fraction){
+			std::vector<double> sorted;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				sorted=recent;
+			}
+			if(sorted.empty()) return 0.0;
+			std::sort(sorted.begin(), sorted.end());
+			return sorted[std::min(sorted.size()-1, size_t(fraction*sorted.size()))];
+		}
+	private:
+		std::mutex mutex;
+		std::vector<double> recent;
+		unsigned next;
+};
+
+struct Server{
+	Server(const Rom& rom, unsigned rooms): cache(rom, rooms), quit(false) {}
+	RoomCache cache;
+	Latencies latencies;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<std::unique_ptr<sf::TcpSocket> > connections;
+	bool quit;
+};
+
+void respond(sf::TcpSocket& socket, const std::string& status, const std::string& type, const Buffer& body){
+	std::stringstream ss;
+	ss<<"HTTP/1.0 "<<status<<"\r\n";
+	ss<<"Content-Type: "<<type<<"\r\n";
+	ss<<"Content-Length: "<<body.size()<<"\r\n";
+	ss<<"Access-Control-Allow-Origin: *\r\n";
+	ss<<"Connection: close\r\n\r\n";
+	std::string head=ss.str();
+	socket.send(head.data(), head.size());
+	if(body.size()) socket.send(&body[0], body.size());
+}
+
+void respond(sf::TcpSocket& socket, const std::string& status, const std::string& text){
+	respond(socket, status, "text/plain", Buffer(text.begin(), text.end()));
+}
+
+//GET /room/state/layers/zoom/x/y.png -- room is an index into Rom::rooms, layers is a mask of Layers
+//GET /stats -- cache and latency figures
+void serve(Server& server, sf::TcpSocket& socket){
+	std::string request;
+	char chunk[512];
+	std::size_t received;
+	while(request.find("\r\n\r\n")==std::string::npos&&request.size()<MAX_REQUEST){
+		if(socket.receive(chunk, sizeof(chunk), received)!=sf::Socket::Done) return;
+		request.append(chunk, received);
+	}
+	Clock::time_point start=Clock::now();
+	char path[256];
+	if(std::sscanf(request.c_str(), "GET %255s", path)!=1){
+		respond(socket, "400 Bad Request", "bad request\n");
+		return;
+	}
+	if(std::string(path)=="/stats"){
+		unsigned rooms;
+		unsigned long hits, misses;
+		server.cache.readStats(rooms, hits, misses);
+		std::stringstream ss;
+		ss<<"rooms cached: "<<rooms<<"\n";
+		ss<<"hits: "<<hits<<", misses: "<<misses<<"\n";
+		ss<<"latency of the last "<<LATENCIES<<" tiles at most: ";
+		ss<<"p50 "<<server.latencies.readPercentile(0.50)*1000<<" ms, p99 "<<server.latencies.readPercentile(0.99)*1000<<" ms\n";
+		respond(socket, "200 OK", ss.str());
+		return;
+	}
+	unsigned room, state, layers, zoom, x, y;
+	char end;
+	if(std::sscanf(path, "/%u/%u/%u/%u/%u/%u.pn%c", &room, &state, &layers, &zoom, &x, &y, &end)!=7||end!='g'||zoom>MAX_ZOOM||room>0xFFFFu){
+		respond(socket, "404 Not Found", "not found\n");
+		return;
+	}
+	std::shared_ptr<const DecodedRoom> decoded=server.cache.get(room, state);
+	if(!decoded){
+		respond(socket, "404 Not Found", "no such room or state\n");
+		return;
+	}
+	Buffer rgba, png;
+	renderTile(*decoded, layers, zoom, x, y, rgba);
+	encodePng(rgba, TILE_PIXELS, TILE_PIXELS, png);
+	respond(socket, "200 OK", "image/png", png);
+	server.latencies.add(std::chrono::duration<double>(Clock::now()-start).count());
+}
+
+void work(Server* server){
+	while(true){
+		std::unique_ptr<sf::TcpSocket> socket;
+		{
+			std::unique_lock<std::mutex> lock(server->mutex);
+			while(!server->quit&&server->connections.empty()) server->wake.wait(lock);
+			if(server->quit) return;
+			socket=std::move(server->connections.front());
+			server->connections.pop_front();
+		}
+		serve(*server, *socket);
+		socket->disconnect();
+	}
+}
+
+//usage: server rom [port] [threads] [rooms cached]
+//serves PNG tiles of rooms over HTTP, see serve for the paths
+int main(int argc, char** argv){
+	if(argc<2){
+		std::cout<<"usage: server rom [port] [threads] [rooms cached]\n";
+		return -1;
+	}
+	unsigned port=argc>2?std::atoi(argv[2]):8080;
+	unsigned threads=argc>3?std::atoi(argv[3]):std::thread::hardware_concurrency();
+	unsigned rooms=argc>4?std::atoi(argv[4]):64;
+	if(!threads) threads=1;
+	if(!rooms) rooms=1;
+	Rom rom;
+	std::string error=rom.open(argv[1]);
+	if(error!=""){
+		std::cout<<argv[1]<<": "<<error<<"\n";
+		return -1;
+	}
+	if(!rom.indexVanilla()){
+		std::cout<<"couldn't index vanilla rom\n";
+		return -1;
+	}
+	makeCrcTable();
+	sf::TcpListener listener;
+	if(listener.listen(port)!=sf::Socket::Done){
+		std::cout<<"couldn't listen on port "<<port<<"\n";
+		return -1;
+	}
+	std::cout<<"serving "<<rom.rooms.size()<<" rooms on port "<<port<<" with "<<threads<<" threads\n";
+	Server server(rom, rooms);
+	std::vector<std::thread> pool;
+	for(unsigned i=0; i<threads; ++i) pool.push_back(std::thread(work, &server));
+	while(true){
+		std::unique_ptr<sf::TcpSocket> socket(new sf::TcpSocket);
+		if(listener.accept(*socket)!=sf::Socket::Done) break;
+		{
+			std::lock_guard<std::mutex> lock(server.mutex);
+			server.connections.push_back(std::move(socket));
+		}
+		server.wake.notify_one();
+	}
+	{
+		std::lock_guard<std::mutex> lock(server.mutex);
+		server.quit=true;
+	}
+	server.wake.notify_all();
+	for(unsigned i=0; i<pool.size(); ++i) pool[i].join();
+	return 0;
+}
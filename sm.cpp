@@ -1,7 +1,12 @@
 #include "sm.hpp"
 
+#include <algorithm>
 #include <fstream>
 #include <cassert>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 using namespace sm;
@@ -43,6 +48,88 @@ const U32 sm::VANILLA_ROOM_OFFSETS[VANILLA_ROOMS]={
 };
 
 const U16 VANILLA_CERES_RIDLEY_ROOM_LAYER_HANDLING=0xC97Bu;
+const U32 COMMON_GRAPHICS_OFFSET=0x1C8000u;
+const U32 COMMON_TILE_TABLE_OFFSET=0x1CA09Du;
+
+//=====profiling=====//
+struct ProfileTotal{
+	ProfileTotal(): calls(0), microseconds(0), bytes(0) {}
+	unsigned long long calls, microseconds, bytes;
+};
+
+struct ProfileEvent{
+	const char* name;
+	long long start, duration;//in microseconds
+	unsigned long long bytes;
+	unsigned thread;
+};
+
+const unsigned MAX_PROFILE_EVENTS=1<<20;//events past this are only added to the totals
+
+mutex profileMutex;
+map<string, ProfileTotal> profileTotals;
+vector<ProfileEvent> profileEvents;
+map<thread::id, unsigned> profileThreads;
+
+long long profileNow(){
+	static const chrono::steady_clock::time_point origin=chrono::steady_clock::now();
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now()-origin).count();
+}
+
+Profile::Scope::Scope(const char* name, bool trace): name(name), trace(trace), bytes(0), start(profileNow()) {}
+
+Profile::Scope::~Scope(){
+	long long duration=profileNow()-start;
+	lock_guard<mutex> lock(profileMutex);
+	ProfileTotal& total=profileTotals[name];
+	++total.calls;
+	total.microseconds+=duration;
+	total.bytes+=bytes;
+	if(!trace||profileEvents.size()>=MAX_PROFILE_EVENTS) return;
+	ProfileEvent event;
+	event.name=name;
+	event.start=start;
+	event.duration=duration;
+	event.bytes=bytes;
+	map<thread::id, unsigned>::iterator i=profileThreads.find(this_thread::get_id());
+	if(i==profileThreads.end()) i=profileThreads.insert(make_pair(this_thread::get_id(), unsigned(profileThreads.size()))).first;
+	event.thread=i->second;
+	profileEvents.push_back(event);
+}
+
+void Profile::clear(){
+	lock_guard<mutex> lock(profileMutex);
+	profileTotals.clear();
+	profileEvents.clear();
+}
+
+string Profile::json(){
+	lock_guard<mutex> lock(profileMutex);
+	stringstream s;
+	s<<"{";
+	for(map<string, ProfileTotal>::iterator i=profileTotals.begin(); i!=profileTotals.end(); ++i){
+		if(i!=profileTotals.begin()) s<<",";
+		s<<"\n\t\""<<i->first<<"\": {\"calls\": "<<i->second.calls;
+		s<<", \"seconds\": "<<i->second.microseconds/1e6;
+		s<<", \"bytes\": "<<i->second.bytes<<"}";
+	}
+	s<<"\n}\n";
+	return s.str();
+}
+
+string Profile::chromeTrace(){
+	lock_guard<mutex> lock(profileMutex);
+	stringstream s;
+	s<<"{\"traceEvents\": [";
+	for(unsigned i=0; i<profileEvents.size(); ++i){
+		const ProfileEvent& e=profileEvents[i];
+		if(i) s<<",";
+		s<<"\n\t{\"name\": \""<<e.name<<"\", \"ph\": \"X\", \"ts\": "<<e.start<<", \"dur\": "<<e.duration;
+		s<<", \"pid\": 0, \"tid\": "<<e.thread<<", \"args\": {\"bytes\": "<<e.bytes<<"}}";
+	}
+	s<<"\n]}\n";
+	return s.str();
+}
 
 //=====SNES format 5 compression=====//
 const unsigned MAX_BLOCK_LENGTH=1024;
@@ -61,8 +148,8 @@ unsigned lzDecompress(const Buffer& source, U32 offset, U32 length, unsigned byt
 	return bytes;
 }
 
-//returns size of compressed data
-unsigned decompress(const Buffer& source, U32 offset, Buffer* destination=NULL){
+unsigned sm::decompress(const Buffer& source, U32 offset, Buffer* destination){
+	SM_PROFILE_SCOPE("decompress");
 	unsigned initialOffset=offset;
 	while(true){
 		if(source[offset]==0xFF) break;//done
@@ -113,6 +200,7 @@ unsigned decompress(const Buffer& source, U32 offset, Buffer* destination=NULL){
 			default: break;
 		}
 	}
+	SM_PROFILE_BYTES(offset+1-initialOffset);
 	return offset+1-initialOffset;
 }
 
@@ -156,6 +244,7 @@ class LzCompressor{
 				offsets[source[i]].push_back(i);
 		}
 		void compress(U32 offset, U32& length, U8 op, Buffer& destination){
+			SM_PROFILE_TOTAL("LzCompressor::compress");
 			unsigned bytes=1;
 			U8 mask=0;
 			bool absolute=true;
@@ -232,6 +321,7 @@ class LzCompressor{
 			}
 			//apply
 			length=bestLength;
+			SM_PROFILE_BYTES(length);
 			putBlockHeader(destination, op, length);
 			if(!absolute) bestStart=offset-bestStart;
 			destination.push_back(bestStart);
@@ -242,8 +332,8 @@ class LzCompressor{
 		vector<unsigned> offsets[256];
 };
 
-void compress(const Buffer& source, Buffer& destination){
-	unsigned i=0;
+//compresses source from i on, appending to destination, which has source before i compressed
+void compressFrom(const Buffer& source, unsigned i, Buffer& destination){
 	unsigned noCompressionLength=0;
 	LzCompressor lzc(source);
 	while(i<source.size()){
@@ -280,7 +370,10 @@ void compress(const Buffer& source, Buffer& destination){
 		if(bestOp==0){
 			++noCompressionLength;
 			++i;
-			if(i>=source.size()) noCompress(source, i, noCompressionLength, destination);
+			if(i>=source.size()||noCompressionLength==MAX_BLOCK_LENGTH){
+				noCompress(source, i, noCompressionLength, destination);
+				noCompressionLength=0;
+			}
 		}
 		else{
 			//actually stick in the no compression block first if it exists
@@ -297,6 +390,48 @@ void compress(const Buffer& source, Buffer& destination){
 	destination.push_back(0xFFu);//done
 }
 
+void sm::compress(const Buffer& source, Buffer& destination){
+	SM_PROFILE_SCOPE("compress");
+	SM_PROFILE_BYTES(source.size());
+	compressFrom(source, 0, destination);
+}
+
+//size in bytes of the compressed block at offset, 0 for the end -- length is set to how many bytes it decompresses to
+unsigned blockSize(const Buffer& source, U32 offset, unsigned& length){
+	if(source[offset]==0xFF) return 0;
+	unsigned header=1;
+	U8 op;
+	if((source[offset]&0xE0)==0xE0){
+		length=((source[offset]&3)<<8|source[offset+1])+1;
+		op=source[offset]>>2&7;
+		header=2;
+	}
+	else{
+		length=(source[offset]&0x1F)+1;
+		op=source[offset]>>5;
+	}
+	switch(op){
+		case 0: return header+length;
+		case 2: case 4: case 5: return header+2;
+		default: return header+1;
+	}
+}
+
+void sm::recompress(const Buffer& source, const Buffer& compressed, unsigned changed, Buffer& destination){
+	SM_PROFILE_SCOPE("recompress");
+	//keep blocks that decompress to bytes before changed -- they only refer back to earlier bytes, so they're still right
+	destination.clear();
+	unsigned kept=0, length, size;
+	U32 offset=0;
+	while((size=blockSize(compressed, offset, length))&&kept+length<=changed){
+		destination.insert(destination.end(), compressed.begin()+offset, compressed.begin()+offset+size);
+		offset+=size;
+		kept+=length;
+	}
+	SM_PROFILE_BYTES(source.size()-kept);
+	compressFrom(source, kept, destination);
+}
+
 //=====translation=====//
 U32 loRomToOffset(U32 address){ return (address&0x7F0000u)>>1|(address&0x7FFFu); }
 U32 loRomToOffset(U8 bank, U16 address){ return (bank&0x7Fu)<<15|(address&0x7FFFu); }
@@ -322,37 +457,129 @@ void writeU24(Buffer& buffer, U32 offset, U32 value){
 	buffer[offset+2]=value>>16&0xFFu;
 }
 
-void readU82D(const Buffer& buffer, U32 offset, Array2D<U8>& u82d){
-	for(unsigned j=0; j<u82d.readJSize(); ++j)
-		for(unsigned i=0; i<u82d.readISize(); ++i){
-			u82d.at(i, j)=buffer[offset];
-			++offset;
-		}
-}
-
-void writeU82D(Buffer& buffer, U32 offset, const Array2D<U8>& u82d){
-	for(unsigned i=0; i<u82d.readISize(); ++i)
-		for(unsigned j=0; j<u82d.readJSize(); ++j){
-			buffer[offset]=u82d.at(i, j);
-			++offset;
-		}
+void writeU32(Buffer& buffer, U32 offset, U32 value){
+	writeU16(buffer, offset, value&0xFFFFu);
+	writeU16(buffer, offset+2, value>>16);
 }
 
-void drawSubtile(const Buffer& subtiles, U16 tileInfo, const vector<Color>& palette, Array2D<Color>& destination, unsigned x, unsigned y){
+//draws palette indices, 0 for transparent -- the generic path, every pixel goes through the flip masks
+void drawSubtile(const Buffer& subtiles, U16 tileInfo, Array2D<U8>& destination, unsigned x, unsigned y){
 	U8 xMask=(tileInfo&0x4000)?7:0;
 	U8 yMask=(tileInfo&0x8000)?7:0;
 	U8 hi=(tileInfo&0x1C00u)>>6;
 	for(unsigned ty=0; ty<8; ++ty){
 		for(unsigned tx=0; tx<8; ++tx){
-			U8 lo=subtiles[(tileInfo&0x3FFu)*64+(tx^xMask)+(ty^yMask)*8];
-			if(lo) destination.at(x+tx, y+ty)=palette[hi|lo];
-			else destination.at(x+tx, y+ty)=Color();
+			U8 lo=subtiles[(tileInfo&0x3FFu)*64+(tx^xMask)*8+(ty^yMask)];
+			destination.at(x+tx, y+ty)=lo?hi|lo:0;
+		}
+	}
+}
+
+U64 reverseBytes(U64 u){
+	u=(u&0x00FF00FF00FF00FFull)<<8 |(u>>8 &0x00FF00FF00FF00FFull);
+	u=(u&0x0000FFFF0000FFFFull)<<16|(u>>16&0x0000FFFF0000FFFFull);
+	return u<<32|u>>32;
+}
+
+//drawSubtile specialized on flips and on whether the subtile has transparent pixels
+//subtiles and Array2D both keep columns contiguous, so each column of 8 pixels is done at once as a U64
+template<bool flipH, bool flipV, bool opaque> void blitSubtile(const U8* subtile, U8 hi, Array2D<U8>& destination, unsigned x, unsigned y){
+	const U64 ONES=0x0101010101010101ull;
+	for(unsigned tx=0; tx<8; ++tx){
+		U64 column;
+		memcpy(&column, subtile+(flipH?7-tx:tx)*8, 8);
+		if(flipV) column=reverseBytes(column);
+		if(opaque) column|=hi*ONES;
+		else{
+			U64 drawn=(column+0x7F*ONES)>>7&ONES;//1 in each byte with a nonzero index -- indices are at most 15, so nothing carries
+			column|=hi*drawn;
 		}
+		memcpy(&destination.at(x+tx, y), &column, 8);
 	}
 }
 
+typedef void (*SubtileKernel)(const U8* subtile, U8 hi, Array2D<U8>& destination, unsigned x, unsigned y);
+
+//indexed by flipH|flipV<<1|opaque<<2
+const SubtileKernel SUBTILE_KERNELS[8]={
+	blitSubtile<false, false, false>, blitSubtile<true, false, false>, blitSubtile<false, true, false>, blitSubtile<true, true, false>,
+	blitSubtile<false, false, true >, blitSubtile<true, false, true >, blitSubtile<false, true, true >, blitSubtile<true, true, true >
+};
+
+void clearSubtile(Array2D<U8>& destination, unsigned x, unsigned y){
+	for(unsigned tx=0; tx<8; ++tx)
+		for(unsigned ty=0; ty<8; ++ty) destination.at(x+tx, y+ty)=0;
+}
+
 U32 tileSetOffset(U8 tileSet){ return 0x7E6A2u+U32(tileSet)*9; }
 
+//index of the next element of a vector whose elements are kept between uses, growing it if needed
+template<class T> unsigned useNext(vector<T>& v, unsigned& used){
+	if(v.size()<=used) v.resize(used+1);
+	return used++;
+}
+
+//=====SNES graphics=====//
+void sm::decodeSubtiles(const Buffer& graphics, Buffer& subtiles){
+	subtiles.resize(graphics.size()/32*64);
+	for(unsigned i=0; i+32<=graphics.size(); i+=32){
+		U8* out=&subtiles[i*2];
+		for(unsigned y=0; y<8; ++y){
+			U8 p0=graphics[i+y*2], p1=graphics[i+y*2+1], p2=graphics[i+y*2+16], p3=graphics[i+y*2+17];
+			for(unsigned x=0; x<8; ++x){
+				unsigned bit=7-x;
+				out[x*8+y]=(p0>>bit&1)|(p1>>bit&1)<<1|(p2>>bit&1)<<2|(p3>>bit&1)<<3;
+			}
+		}
+	}
+}
+
+void sm::assembleTiles(const Buffer& subtiles, const vector<TileAssembler>& assemblers, vector<Array2D<U8> >& tiles, bool generic){
+	SM_PROFILE_SCOPE("assembleTiles");
+	unsigned count=subtiles.size()/64;
+	Buffer opaque;
+	if(!generic){
+		opaque.resize(count);
+		for(unsigned i=0; i<count; ++i){
+			U8 o=1;
+			for(unsigned j=0; j<64; ++j) o&=subtiles[i*64+j]!=0;
+			opaque[i]=o;
+		}
+	}
+	tiles.resize(assemblers.size());
+	for(unsigned i=0; i<assemblers.size(); ++i){
+		tiles[i].resize(TILE_SIZE, TILE_SIZE);
+		const U16 infos[4]={assemblers[i].ul, assemblers[i].ur, assemblers[i].dl, assemblers[i].dr};
+		for(unsigned q=0; q<4; ++q){
+			U16 info=infos[q];
+			unsigned x=q%2*TILE_SIZE/2, y=q/2*TILE_SIZE/2, subtile=info&0x3FFu;
+			if(subtile>=count) clearSubtile(tiles[i], x, y);
+			else if(generic) drawSubtile(subtiles, info, tiles[i], x, y);
+			else SUBTILE_KERNELS[(info>>14&1)|(info>>15&1)<<1|opaque[subtile]<<2](&subtiles[subtile*64], (info&0x1C00u)>>6, tiles[i], x, y);
+		}
+	}
+	SM_PROFILE_BYTES(assemblers.size()*TILE_SIZE*TILE_SIZE);
+}
+
+//=====class RoomRegistry=====//
+const U16 RoomRegistry::NONE;
+const U32 RoomRegistry::BANK_START;
+
+void RoomRegistry::clear(){
+	offsets.clear();
+	indices.clear();
+}
+
+U16 RoomRegistry::add(U32 offset){
+	U16 room=find(offset);
+	if(room!=NONE||offset-BANK_START>=0x8000u) return room;
+	if(indices.empty()) indices.assign(0x8000u, NONE);
+	room=offsets.size();
+	offsets.push_back(offset);
+	indices[offset-BANK_START]=room;
+	return room;
+}
+
 //=====class Rom=====//
 string Rom::open(string fileName){
 	header.clear();
@@ -368,6 +595,9 @@ string Rom::open(string fileName){
 	}
 	//check for PAL
 	if(buffer[0x7FD9u]>=2) return "ROM is PAL. This doesn't work on PAL ROMs.";
+	//rooms
+	rooms.clear();
+	for(unsigned i=0; i<VANILLA_ROOMS; ++i) rooms.add(VANILLA_ROOM_OFFSETS[i]);
 	//finish
 	return "";
 }
@@ -376,12 +606,9 @@ bool Rom::indexVanilla(){
 	//saves
 	Save::index(index);
 	//transitions from saves
-	for(unsigned offset=Save::START; offset<Save::END; offset+=Save::SIZE){
-		Save s(*this);
-		s.open(offset);
-		Transition t(*this);
-		t.index(s.transition, index);
-	}
+	Transition t(*this);
+	for(SaveView s(buffer, Save::START); !s.atEnd(); s=s.next())
+		t.index(s.readTransition(), index);
 	//mode 7 graphics
 	Mode7 mode7(*this);
 	for(U8 i=Mode7::FIRST_TILE_SET; i<=Mode7::LAST_TILE_SET; ++i)
@@ -396,6 +623,7 @@ bool Rom::indexVanilla(){
 }
 
 bool Rom::takeSpace(U8 bank, U16 size, U32& offset){
+	SM_PROFILE_SCOPE("takeSpace");
 	U32 bankStart=loRomToOffset(bank, 0);
 	offset=bankStart;
 	for(unsigned i=bankStart, sizeSoFar=0; i<bankStart+0x8000u; ++i){
@@ -403,6 +631,7 @@ bool Rom::takeSpace(U8 bank, U16 size, U32& offset){
 			++sizeSoFar;
 			if(sizeSoFar==size){
 				index.set(offset, size, HACKED);
+				SM_PROFILE_BYTES(i+1-bankStart);//bytes scanned
 				return true;
 			}
 		}
@@ -411,6 +640,7 @@ bool Rom::takeSpace(U8 bank, U16 size, U32& offset){
 			sizeSoFar=0;
 		}
 	}
+	SM_PROFILE_BYTES(0x8000u);
 	return false;
 }
 
@@ -420,6 +650,39 @@ bool Rom::takeSpace(U8 minBank, U8 maxBank, U16 size, U32& offset){
 	return false;
 }
 
+void Rom::freeSpace(U32 offset, U16 size){
+	index.set(offset, size, HACKABLE);
+}
+
+void Rom::claimSpace(U32 offset, U16 size){
+	index.set(offset, size, HACKED);
+}
+
+void Rom::measureSpace(vector<BankSpace>& banks) const{
+	banks.assign(buffer.size()/0x8000u, BankSpace());
+	for(unsigned b=0; b<banks.size(); ++b){
+		BankSpace& space=banks[b];
+		space.bank=offsetToLoRom(b<<15)>>16;
+		unsigned run=0;
+		for(U32 i=b<<15; i<(b+1)<<15; ++i)
+			switch(index[i]){
+				case HACKABLE:
+					++space.hackable;
+					if(!run++) ++space.freeRuns;
+					space.largestFree=max(space.largestFree, run);
+					break;
+				case HACKED:
+					++space.hacked;
+					run=0;
+					break;
+				default:
+					++space.unknown;
+					run=0;
+					break;
+			}
+	}
+}
+
 bool Rom::save(string fileName){
 	ofstream file(fileName.c_str(), ios::binary);
 	for(unsigned i=0; i<header.size(); ++i) file.put(header[i]);
@@ -434,35 +697,100 @@ void Rom::dummify(){
 			buffer[i]=0xD0u;
 }
 
+void addCompressed(vector<Compressed>& found, Compressed::Kind kind, U32 offset){
+	for(unsigned i=0; i<found.size(); ++i)
+		if(found[i].offset==offset) return;
+	found.push_back(Compressed(kind, offset));
+}
+
+void Rom::findCompressed(vector<Compressed>& found) const{
+	found.clear();
+	addCompressed(found, Compressed::COMMON_GRAPHICS, COMMON_GRAPHICS_OFFSET);
+	addCompressed(found, Compressed::COMMON_TILE_TABLE, COMMON_TILE_TABLE_OFFSET);
+	vector<bool> tileSets(256, false);
+	Header header;
+	for(unsigned i=0; i<rooms.size(); ++i){
+		header.read(buffer, rooms.readOffset(i));
+		for(unsigned j=0; j<header.stateInfo.size(); ++j){
+			State state(buffer, header.stateInfo[j].state);
+			addCompressed(found, Compressed::LEVEL, state.tiles);
+			tileSets[state.tileSet]=true;
+		}
+	}
+	for(unsigned i=0; i<tileSets.size(); ++i){
+		if(!tileSets[i]) continue;
+		View tileSet(buffer, tileSetOffset(i));
+		bool mode7=Mode7::FIRST_TILE_SET<=i&&i<=Mode7::LAST_TILE_SET;
+		addCompressed(found, Compressed::TILE_TABLE, loRomToOffset(tileSet.readU24(0)));
+		addCompressed(found, mode7?Compressed::MODE7:Compressed::GRAPHICS, loRomToOffset(tileSet.readU24(3)));
+		addCompressed(found, Compressed::PALETTE, loRomToOffset(tileSet.readU24(6)));
+	}
+}
+
+//=====struct Compressed=====//
+string Compressed::kindDescription(Kind kind){
+	switch(kind){
+		case LEVEL            : return "level";
+		case MODE7            : return "mode 7";
+		case GRAPHICS         : return "graphics";
+		case TILE_TABLE       : return "tile table";
+		case PALETTE          : return "palette";
+		case COMMON_GRAPHICS  : return "common graphics";
+		case COMMON_TILE_TABLE: return "common tile table";
+		default: break;
+	}
+	return "";
+}
+
+//=====class SharedRom=====//
+SharedRom::Snapshot SharedRom::snapshot() const{
+	lock_guard<mutex> lock(currentMutex);
+	return current;
+}
+
+SharedRom::Writer::Writer(SharedRom& shared): shared(&shared), turn(shared.writerMutex){
+	rom=*shared.snapshot();
+}
+
+void SharedRom::Writer::commit(){
+	Snapshot next=make_shared<const Rom>(rom);
+	lock_guard<mutex> lock(shared->currentMutex);
+	shared->current.swap(next);
+}
+
 //=====class Transition=====//
 void Transition::index(U32 offset, Rom::Index& index){
 	index.set(offset, SIZE, Rom::HACKABLE);
 }
 
 void Transition::open(U32 offset){
-	room=readU16(rom->buffer, offset);
-	if(room!=0) room=loRomToOffset(Room::BANK, room);
-	flags=rom->buffer[offset+2];
-	direction=rom->buffer[offset+3];
-	animationX=rom->buffer[offset+4];
-	animationY=rom->buffer[offset+5];
-	x=rom->buffer[offset+6];
-	y=rom->buffer[offset+7];
-	distance=readU16(rom->buffer, offset+8);
-	scroll=readU16(rom->buffer, offset+10);
+	open(TransitionView(rom->buffer, offset));
+}
+
+void Transition::open(const TransitionView& view){
+	room=view.readRoom();
+	flags=view.readFlags();
+	direction=view.readDirection();
+	animationX=view.readAnimationX();
+	animationY=view.readAnimationY();
+	x=view.readX();
+	y=view.readY();
+	distance=view.readDistance();
+	scroll=view.readScroll();
 }
 
 bool Transition::save(U32& offset){
-	if(!rom->takeSpace(BANK, SIZE, offset)) return false;
-	writeU16(rom->buffer, offset, room==0?0:offsetToLoRom16(room));
-	rom->buffer[offset+2]=flags;
-	rom->buffer[offset+3]=direction;
-	rom->buffer[offset+4]=animationX;
-	rom->buffer[offset+5]=animationY;
-	rom->buffer[offset+6]=x;
-	rom->buffer[offset+7]=y;
-	writeU16(rom->buffer, offset+8, distance);
-	writeU16(rom->buffer, offset+10, scroll);
+	if(!writable) return false;
+	if(!writable->takeSpace(BANK, SIZE, offset)) return false;
+	writeU16(writable->buffer, offset, room==0?0:offsetToLoRom16(room));
+	writable->buffer[offset+2]=flags;
+	writable->buffer[offset+3]=direction;
+	writable->buffer[offset+4]=animationX;
+	writable->buffer[offset+5]=animationY;
+	writable->buffer[offset+6]=x;
+	writable->buffer[offset+7]=y;
+	writeU16(writable->buffer, offset+8, distance);
+	writeU16(writable->buffer, offset+10, scroll);
 	return true;
 }
 
@@ -475,32 +803,54 @@ U32 Save::readRegionTable(Region region){
 	return loRomToOffset(BANK, readU16(rom->buffer, REGION_TABLES+2*region));
 }
 
-void Save::setRegionTable(Region region, U32 offset){
-	writeU16(rom->buffer, REGION_TABLES+2*region, offsetToLoRom16(offset));
+bool Save::setRegionTable(Region region, U32 offset){
+	if(!writable) return false;
+	writeU16(writable->buffer, REGION_TABLES+2*region, offsetToLoRom16(offset));
+	return true;
 }
 
 void Save::open(U32 offset){
-	room=loRomToOffset(Room::BANK, readU16(rom->buffer, offset));
-	transition=loRomToOffset(Transition::BANK, readU16(rom->buffer, offset+2));
-	unknown=readU16(rom->buffer, offset+4);
-	scrollX=readU16(rom->buffer, offset+6);
-	scrollY=readU16(rom->buffer, offset+8);
-	samusY=readU16(rom->buffer, offset+10);
-	samusX=readU16(rom->buffer, offset+12);
+	open(SaveView(rom->buffer, offset));
+}
+
+void Save::open(const SaveView& view){
+	room=view.readRoom();
+	transition=view.readTransition();
+	unknown=view.readUnknown();
+	scrollX=view.readScrollX();
+	scrollY=view.readScrollY();
+	samusY=view.readSamusY();
+	samusX=view.readSamusX();
 }
 
 bool Save::save(U32& offset){
-	if(!rom->takeSpace(BANK, SIZE, offset)) return false;
-	writeU16(rom->buffer, offset, offsetToLoRom16(room));
-	writeU16(rom->buffer, offset+2, offsetToLoRom16(transition));
-	writeU16(rom->buffer, offset+4, unknown);
-	writeU16(rom->buffer, offset+6, scrollX);
-	writeU16(rom->buffer, offset+8, scrollY);
-	writeU16(rom->buffer, offset+10, samusY);
-	writeU16(rom->buffer, offset+12, samusX);
+	if(!writable) return false;
+	if(!writable->takeSpace(BANK, SIZE, offset)) return false;
+	writeU16(writable->buffer, offset, offsetToLoRom16(room));
+	writeU16(writable->buffer, offset+2, offsetToLoRom16(transition));
+	writeU16(writable->buffer, offset+4, unknown);
+	writeU16(writable->buffer, offset+6, scrollX);
+	writeU16(writable->buffer, offset+8, scrollY);
+	writeU16(writable->buffer, offset+10, samusY);
+	writeU16(writable->buffer, offset+12, samusX);
 	return true;
 }
 
+//=====class TransitionView=====//
+U32 TransitionView::readRoom() const{
+	U16 room=readU16(0);
+	return room?loRomToOffset(Room::BANK, room):0;
+}
+
+//=====class SaveView=====//
+U32 SaveView::readRoom() const{
+	return loRomToOffset(Room::BANK, readU16(0));
+}
+
+U32 SaveView::readTransition() const{
+	return loRomToOffset(Transition::BANK, readU16(2));
+}
+
 //=====class Mode7=====//
 void Mode7::index(U8 tileSet, Rom::Index& index){
 	unsigned offset=dataOffset(tileSet);
@@ -510,30 +860,122 @@ void Mode7::index(U8 tileSet, Rom::Index& index){
 void Mode7::open(U8 tileSet){
 	data.clear();
 	tiles.clear();
-	decompress(rom->buffer, dataOffset(tileSet), &data);
-	tiles.resize(128, 128);
-	for(unsigned i=0; i<tiles.readISize(); ++i)
-		for(unsigned j=0; j<tiles.readJSize(); ++j)
-			tiles.at(i, j)=data[2*(j*tiles.readISize()+i)];
+	this->tileSet=tileSet;
+	compressedOffset=dataOffset(tileSet);
+	unsigned size=decompress(rom->buffer, compressedOffset, &data);
+	compressed.assign(rom->buffer.begin()+compressedOffset, rom->buffer.begin()+compressedOffset+size);
+	tiles.resize(SIZE, SIZE);
+	for(unsigned j=0, k=0; j<SIZE; ++j)
+		for(unsigned i=0; i<SIZE; ++i, k+=2)
+			tiles.at(i, j)=data[k];
+	savedTiles=tiles;
+	bitmap.resize(SIZE*TILE_SIZE/2, SIZE*TILE_SIZE/2);
+	for(unsigned i=0; i<SIZE; ++i)
+		for(unsigned j=0; j<SIZE; ++j) drawTile(i, j);
+}
+
+//usage of all of the space, UNKNOWN if it's mixed
+Rom::Usage readUsage(const Rom& rom, U32 offset, unsigned size){
+	Rom::Usage usage=rom.readUsage(offset);
+	for(unsigned i=1; i<size; ++i)
+		if(rom.readUsage(offset+i)!=usage) return Rom::UNKNOWN;
+	return usage;
 }
 
 bool Mode7::save(U8 tileSet){
-	for(unsigned i=0; i<tiles.readISize(); ++i)
-		for(unsigned j=0; j<tiles.readJSize(); ++j)
-			data[2*(j*tiles.readISize()+i)]=tiles.at(i, j);
-	Buffer compressed;
-	compress(data, compressed);
-	unsigned offset;
-	if(!rom->takeSpace(Mode7::FIRST_BANK, Mode7::LAST_BANK, compressed.size(), offset))
-		return false;
-	writeU24(rom->buffer, tileSetOffset(tileSet)+3, offsetToLoRom(offset));
-	for(unsigned i=0; i<compressed.size(); ++i) rom->buffer[offset+i]=compressed[i];
+	if(!writable||data.empty()) return false;
+	//write changed tiles into data, finding the first
+	unsigned changed=data.size();
+	for(unsigned j=0, k=0; j<SIZE; ++j)
+		for(unsigned i=0; i<SIZE; ++i, k+=2)
+			if(tiles.at(i, j)!=savedTiles.at(i, j)){
+				data[k]=tiles.at(i, j);
+				changed=min(changed, k);
+			}
+	bool sameTileSet=tileSet==this->tileSet&&dataOffset(tileSet)==compressedOffset;
+	if(sameTileSet&&changed==data.size()) return true;
+	Buffer recompressed;
+	recompress(data, compressed, changed, recompressed);
+	//rewrite in place if it fits, otherwise move
+	U32 offset=compressedOffset;
+	Rom::Usage usage=readUsage(*writable, compressedOffset, compressed.size());
+	if(sameTileSet&&usage!=Rom::UNKNOWN&&recompressed.size()<=compressed.size()){
+		writable->claimSpace(offset, recompressed.size());
+		if(usage==Rom::HACKED) writable->freeSpace(offset+recompressed.size(), compressed.size()-recompressed.size());
+	}
+	else{
+		if(!writable->takeSpace(Mode7::FIRST_BANK, Mode7::LAST_BANK, recompressed.size(), offset))
+			return false;
+		if(sameTileSet&&usage==Rom::HACKED) writable->freeSpace(compressedOffset, compressed.size());
+		writeU24(writable->buffer, tileSetOffset(tileSet)+3, offsetToLoRom(offset));
+	}
+	for(unsigned i=0; i<recompressed.size(); ++i) writable->buffer[offset+i]=recompressed[i];
+	//finish
+	this->tileSet=tileSet;
+	compressed.swap(recompressed);
+	compressedOffset=offset;
+	savedTiles=tiles;
 	return true;
 }
 
 void Mode7::clear(){
 	data.clear();
 	tiles.clear();
+	compressed.clear();
+	savedTiles.clear();
+	bitmap.clear();
+}
+
+void Mode7::setTile(unsigned i, unsigned j, U8 tile){
+	tiles.at(i, j)=tile;
+	drawTile(i, j);
+}
+
+void Mode7::drawTile(unsigned i, unsigned j){
+	const unsigned PIXELS=TILE_SIZE/2;
+	U8 tile=tiles.at(i, j);
+	for(unsigned x=0; x<PIXELS; ++x)
+		for(unsigned y=0; y<PIXELS; ++y) bitmap.at(i*PIXELS+x, j*PIXELS+y)=readPixel(tile, x, y);
+}
+
+//signed value of the low bits of a register
+int signExtend(U16 value, unsigned bits){
+	int shift=8*sizeof(int)-bits;
+	return int(unsigned(value)<<shift)>>shift;
+}
+
+//follows the SNES's math, including its rounding
+void Mode7::drawAffine(Array2D<U8>& destination, const Affine& affine, unsigned w, unsigned h) const{
+	if(tiles.size()!=SIZE*SIZE||data.empty()){//not open
+		destination.clear();
+		destination.resize(w, h);
+		return;
+	}
+	destination.resize(w, h);
+	int a=signExtend(affine.a, 16), b=signExtend(affine.b, 16), c=signExtend(affine.c, 16), d=signExtend(affine.d, 16);
+	int hOffset=signExtend(affine.h, 13), vOffset=signExtend(affine.v, 13);
+	int xCenter=signExtend(affine.x, 13), yCenter=signExtend(affine.y, 13);
+	int hClip=hOffset-xCenter, vClip=vOffset-yCenter;
+	hClip=hClip&0x2000?hClip|~1023:hClip&1023;
+	vClip=vClip&0x2000?vClip|~1023:vClip&1023;
+	U8 overflow=affine.settings>>6;
+	for(unsigned row=0; row<h; ++row){
+		int y=row+1;//the SNES counts the first line shown as 1
+		if(affine.settings&0x02u) y=255-y;
+		int originX=(a*hClip&~63)+(b*vClip&~63)+(b*y&~63)+(xCenter<<8);
+		int originY=(c*hClip&~63)+(d*vClip&~63)+(d*y&~63)+(yCenter<<8);
+		for(unsigned column=0; column<w; ++column){
+			int x=affine.settings&0x01u?255-int(column):int(column);
+			int pixelX=(originX+a*x)>>8;
+			int pixelY=(originY+c*x)>>8;
+			bool outside=(pixelX|pixelY)&~1023;
+			if(outside&&overflow==2) destination.at(column, row)=0;
+			else{
+				U8 tile=outside&&overflow==3?0:tiles.at(pixelX>>3&(SIZE-1), pixelY>>3&(SIZE-1));
+				destination.at(column, row)=readPixel(tile, pixelX&7, pixelY&7);
+			}
+		}
+	}
 }
 
 U32 Mode7::dataOffset(U8 tileSet){
@@ -557,32 +999,39 @@ string Header::codeDescription(Code code){
 	return "";
 }
 
-Header::Header(const Buffer& buffer, unsigned offset):
-	index(buffer[offset]),
-	region(Region(buffer[offset+1])),
-	x(buffer[offset+2]),
-	y(buffer[offset+3]),
-	width(buffer[offset+4]),
-	height(buffer[offset+5]),
-	upScroll(buffer[offset+6]),
-	downScroll(buffer[offset+7]),
-	graphicsFlags(buffer[offset+8]),
-	doors(loRomToOffset(DOOR_BANK, readU16(buffer, offset+9)))
-{
+Header::Header(const Buffer& buffer, U32 offset){
+	read(buffer, offset);
+}
+
+void Header::read(const Buffer& buffer, U32 offset){
+	index=buffer[offset];
+	region=Region(buffer[offset+1]);
+	x=buffer[offset+2];
+	y=buffer[offset+3];
+	width=buffer[offset+4];
+	height=buffer[offset+5];
+	upScroll=buffer[offset+6];
+	downScroll=buffer[offset+7];
+	graphicsFlags=buffer[offset+8];
+	doors=loRomToOffset(DOOR_BANK, readU16(buffer, offset+9));
 	offset+=MAIN_SIZE;
-	while(true){
-		stateInfo.push_back(StateInfo());
-		stateInfo.back().code=Code(readU16(buffer, offset));
+	//count states first so stateInfo is only resized once
+	unsigned states=1;
+	for(U32 i=offset; Code(readU16(buffer, i))!=STANDARD; i+=stateInfoSize(Code(readU16(buffer, i)))) ++states;
+	stateInfo.resize(states);
+	for(unsigned s=0; s<states; ++s){
+		StateInfo& info=stateInfo[s];
+		info.code=Code(readU16(buffer, offset));
 		offset+=2;
-		for(unsigned i=0; i<fieldSize(stateInfo.back().code); ++i){
-			stateInfo.back().fields.push_back(buffer[offset]);
+		for(unsigned i=0; i<fieldSize(info.code); ++i){
+			info.fields[i]=buffer[offset];
 			++offset;
 		}
-		if(stateInfo.back().code==STANDARD){
-			stateInfo.back().state=offset;
+		if(info.code==STANDARD){
+			info.state=offset;
 			break;
 		}
-		stateInfo.back().state=loRomToOffset(State::BANK, readU16(buffer, offset));
+		info.state=loRomToOffset(State::BANK, readU16(buffer, offset));
 		offset+=2;
 	}
 }
@@ -608,7 +1057,7 @@ void Header::write(Buffer& buffer, U32 offset) const{
 	for(unsigned i=0; i<stateInfo.size(); ++i){
 		writeU16(buffer, offset, stateInfo[i].code);
 		offset+=2;
-		for(unsigned j=0; j<stateInfo[i].fields.size(); ++j){
+		for(unsigned j=0; j<fieldSize(stateInfo[i].code); ++j){
 			buffer[offset]=stateInfo[i].fields[j];
 			++offset;
 		}
@@ -673,6 +1122,59 @@ void State::write(Buffer& buffer, U32 offset) const{
 	writeU16(buffer, offset+24, layerHandling);
 }
 
+//=====class ScrollMap=====//
+void ScrollMap::resize(unsigned screensWide, unsigned screensHigh, U8 value){
+	w=screensWide;
+	h=screensHigh;
+	U64 pattern=0;
+	for(unsigned i=0; i<32; ++i) pattern|=U64(value&3)<<2*i;
+	screens.assign((w*h+31)/32, pattern);
+	visible.assign((w*h+63)/64, (value&3)==HIDDEN?0:~0ull);
+	if(w*h%32) screens.back()&=(1ull<<2*(w*h%32))-1;
+	if(w*h%64) visible.back()&=(1ull<<w*h%64)-1;
+}
+
+void ScrollMap::read(const Buffer& buffer, U32 offset, unsigned screensWide, unsigned screensHigh){
+	resize(screensWide, screensHigh);
+	for(unsigned y=0; y<h; ++y)
+		for(unsigned x=0; x<w; ++x){
+			setScreen(x, y, buffer[offset]&3);
+			++offset;
+		}
+}
+
+void ScrollMap::write(Buffer& buffer, U32 offset) const{
+	for(unsigned y=0; y<h; ++y)
+		for(unsigned x=0; x<w; ++x){
+			buffer[offset]=readScreen(x, y);
+			++offset;
+		}
+}
+
+void ScrollMap::setScreen(unsigned x, unsigned y, U8 value){
+	unsigned k=x+y*w;
+	screens[k/32]=(screens[k/32]&~(3ull<<2*(k%32)))|U64(value&3)<<2*(k%32);
+	visible[k/64]=(visible[k/64]&~(1ull<<k%64))|U64((value&3)!=HIDDEN)<<k%64;
+}
+
+void ScrollMap::clampCamera(unsigned screenX, unsigned screenY, int& x, int& y, unsigned viewW, unsigned viewH) const{
+	if(!w||!h) return;
+	screenX=min(screenX, w-1);
+	screenY=min(screenY, h-1);
+	//visible screens either side of screenX, screenY -- which is reachable itself even if hidden
+	unsigned left=screenX, right=screenX, top=screenY, bottom=screenY;
+	while(left>0&&readVisible(left-1, screenY)) --left;
+	while(right+1<w&&readVisible(right+1, screenY)) ++right;
+	while(top>0&&readVisible(screenX, top-1)) --top;
+	while(bottom+1<h&&readVisible(screenX, bottom+1)) ++bottom;
+	const int screen=SCREEN_SIZE*TILE_SIZE;
+	int minX=left*screen, maxX=max(minX, int((right+1)*screen)-int(viewW));
+	int minY=top*screen+(readScreen(screenX, top)==CROPPED?int(CROP):0);
+	int maxY=max(minY, int((bottom+1)*screen)-int(viewH)-(readScreen(screenX, bottom)==CROPPED?int(CROP):0));
+	x=min(max(x, minX), maxX);
+	y=min(max(y, minY), maxY);
+}
+
 //=====struct TileLayer=====//
 TileLayer::TileLayer(const Buffer& buffer, U32 offset):
 	index(readU16(buffer, offset)&0x3FFu),
@@ -687,15 +1189,19 @@ void TileLayer::write(Buffer& buffer) const{
 }
 
 //=====struct Enemy=====//
-Enemy::Enemy(const Buffer& buffer, U32 offset):
-	species(readU16(buffer, offset)),
-	x(readU16(buffer, offset+2)),
-	y(readU16(buffer, offset+4)),
-	field1(readU16(buffer, offset+6)),
-	field2(readU16(buffer, offset+8)),
-	field3(readU16(buffer, offset+10)),
-	field4(readU16(buffer, offset+12)),
-	field5(readU16(buffer, offset+14))
+Enemy::Enemy(const Buffer& buffer, U32 offset){
+	*this=Enemy(EnemyView(buffer, offset));
+}
+
+Enemy::Enemy(const EnemyView& view):
+	species(view.readSpecies()),
+	x(view.readX()),
+	y(view.readY()),
+	field1(view.readField(1)),
+	field2(view.readField(2)),
+	field3(view.readField(3)),
+	field4(view.readField(4)),
+	field5(view.readField(5))
 {}
 
 void Enemy::write(Buffer& buffer, U32 offset) const{
@@ -710,12 +1216,16 @@ void Enemy::write(Buffer& buffer, U32 offset) const{
 }
 
 //=====struct Plm=====//
-Plm::Plm(const Buffer& buffer, U32 offset):
-	type(readU16(buffer, offset)),
-	x(buffer[offset+2]),
-	y(buffer[offset+3]),
-	field1(buffer[offset+4]),
-	field2(buffer[offset+5])
+Plm::Plm(const Buffer& buffer, U32 offset){
+	*this=Plm(PlmView(buffer, offset));
+}
+
+Plm::Plm(const PlmView& view):
+	type(view.readType()),
+	x(view.readX()),
+	y(view.readY()),
+	field1(view.readField(1)),
+	field2(view.readField(2))
 {}
 
 void Plm::write(Buffer& buffer, U32 offset) const{
@@ -727,6 +1237,8 @@ void Plm::write(Buffer& buffer, U32 offset) const{
 }
 
 //=====class Room=====//
+const unsigned Room::Handles::NONE;
+
 bool Room::index(U32 offset, Rom::Index& index){
 	//header
 	Header indexingHeader=Header(rom->buffer, offset);
@@ -788,32 +1300,41 @@ bool Room::index(U32 offset, Rom::Index& index){
 
 bool Room::open(U32 offset){
 	//header
-	header=Header(rom->buffer, offset);
+	headerOffset=offset;
+	header.read(rom->buffer, offset);
+	taken.clear();
 	//states
-	states.clear();
-	for(unsigned i=0; i<header.stateInfo.size(); ++i)
-		states.push_back(State(rom->buffer, header.stateInfo[i].state));
-	//stuff that can be shared between states
-	scroll.clear();
-	tiles.clear();
-	enemies.clear();
-	plm.clear();
-	unsigned s, doorsInRoom=0;
+	states.resize(header.stateInfo.size());
+	for(unsigned i=0; i<header.stateInfo.size(); ++i){
+		states[i]=State(rom->buffer, header.stateInfo[i].state);
+	}
+	//stuff that can be shared between states -- elements left over from earlier opens are reused
+	handles.assign(states.size(), Handles());
+	for(unsigned i=0; i<compressedTiles.size(); ++i) compressedTiles[i].clear();
+	scroll.reserve(states.size());
+	tiles.reserve(states.size());
+	enemies.reserve(states.size());
+	plm.reserve(states.size());
+	unsigned s, doorsInRoom=0, scrolls=0, tileArrays=0, enemyLists=0, plmLists=0;
 	for(s=0; s<states.size(); ++s){
 		State& state=states[s];
+		Handles& handle=handles[s];
 		//scroll data
 		if(state.scroll>=0x8000u){
-			if(scroll.find(state.scroll)==scroll.end()){
-				scroll[state.scroll].resize(header.width, header.height);
-				readU82D(rom->buffer, state.scroll, scroll[state.scroll]);
+			if((handle.scroll=sharedHandle(s, &State::scroll, &Handles::scroll))==Handles::NONE){
+				handle.scroll=useNext(scroll, scrolls);
+				scroll[handle.scroll].read(rom->buffer, state.scroll, header.width, header.height);
 			}
 		}
 		else if(state.scroll>=2) return false;
+		else constantScroll[state.scroll].resize(header.width, header.height, state.scroll);
 		//tile data
-		if(tiles.find(state.tiles)==tiles.end()){
-			Buffer buffer;
+		if((handle.tiles=sharedHandle(s, &State::tiles, &Handles::tiles))==Handles::NONE){
+			handle.tiles=useNext(tiles, tileArrays);
+			Buffer& buffer=scratch;
+			buffer.clear();
 			decompress(rom->buffer, state.tiles, &buffer);
-			Array2D<Tile>& stateTiles=tiles[state.tiles];
+			Array2D<Tile>& stateTiles=tiles[handle.tiles];
 			stateTiles.resize(header.width*SCREEN_SIZE, header.height*SCREEN_SIZE);
 			U16 roomSize=readU16(buffer, 0);
 			for(unsigned i=0; i<stateTiles.readISize(); ++i)
@@ -824,26 +1345,29 @@ bool Room::open(U32 offset){
 						stateTiles.at(i, j).layer2=TileLayer(buffer, 2+roomSize+roomSize/2+2*(i+j*stateTiles.readISize()));
 						stateTiles.at(i, j).hasLayer2=true;
 					}
-					else stateTiles.at(i, j).hasLayer2=false;
+					else{
+						stateTiles.at(i, j).layer2=TileLayer();
+						stateTiles.at(i, j).hasLayer2=false;
+					}
 					if(stateTiles.at(i, j).layer1.property==9)
 						doorsInRoom=max(doorsInRoom, unsigned(stateTiles.at(i, j).bts+1));
 				}
 		}
 		//enemies
-		if(state.enemies&&enemies.find(state.enemies)==enemies.end()){
-			offset=state.enemies;
-			while(readU16(rom->buffer, offset)!=Enemy::SENTINEL){
-				enemies[state.enemies].push_back(Enemy(rom->buffer, offset));
-				offset+=Enemy::SIZE;
-			}
+		if(state.enemies&&(handle.enemies=sharedHandle(s, &State::enemies, &Handles::enemies))==Handles::NONE){
+			handle.enemies=useNext(enemies, enemyLists);
+			vector<Enemy>& stateEnemies=enemies[handle.enemies];
+			stateEnemies.clear();
+			for(EnemyView enemy(rom->buffer, state.enemies); !enemy.atEnd(); enemy=enemy.next())
+				stateEnemies.push_back(Enemy(enemy));
 		}
 		//post load modifications
-		if(state.plm&&plm.find(state.plm)==plm.end()){
-			offset=state.plm;
-			while(readU16(rom->buffer, offset)!=Plm::SENTINEL){
-				plm[state.plm].push_back(Plm(rom->buffer, offset));
-				offset+=Plm::SIZE;
-			}
+		if(state.plm&&(handle.plm=sharedHandle(s, &State::plm, &Handles::plm))==Handles::NONE){
+			handle.plm=useNext(plm, plmLists);
+			vector<Plm>& statePlm=plm[handle.plm];
+			statePlm.clear();
+			for(PlmView p(rom->buffer, state.plm); !p.atEnd(); p=p.next())
+				statePlm.push_back(Plm(p));
 		}
 	}
 	//doors
@@ -856,109 +1380,186 @@ bool Room::open(U32 offset){
 }
 
 bool Room::save(U32& offset){
-	//map identifier to written location
-	map<U32, U32> scrollHacks;
-	map<U32, U32> tileHacks;
-	map<U32, U32> enemyHacks;
-	map<U32, U32> plmHacks;
+	if(!writable) return false;
+	SavePlan plan;
+	if(!planSave(plan)){
+		release(plan);
+		return false;
+	}
+	//commit
+	for(unsigned i=0; i<plan.blocks.size(); ++i)
+		for(unsigned j=0; j<plan.blocks[i].data.size(); ++j)
+			writable->buffer[plan.blocks[i].offset+j]=plan.blocks[i].data[j];
+	//free what earlier saves took and this one moved away from -- never what open found, other rooms may share it
+	const Block& headerBlock=plan.blocks[0];
+	vector<Span> kept;
+	for(unsigned i=0; i<taken.size(); ++i)
+		if(taken[i].offset<headerBlock.offset||taken[i].offset>=headerBlock.offset+headerBlock.data.size())
+			writable->freeSpace(taken[i].offset, taken[i].size);
+		else kept.push_back(taken[i]);//header rewritten in place
+	for(unsigned i=0; i<plan.blocks.size(); ++i)
+		if(plan.blocks[i].taken){
+			Span span={plan.blocks[i].offset, (unsigned)plan.blocks[i].data.size()};
+			kept.push_back(span);
+		}
+	taken.swap(kept);
+	header=plan.header;
+	states=plan.states;
+	offset=headerOffset;
+	return true;
+}
+
+bool Room::measureSave(BankUsage& usage){
+	usage.clear();
+	if(!writable) return false;
+	SavePlan plan;
+	bool result=planSave(plan);
+	release(plan);
+	for(unsigned i=0; i<plan.blocks.size(); ++i)
+		if(plan.blocks[i].taken) usage[offsetToLoRom(plan.blocks[i].offset)>>16]+=plan.blocks[i].data.size();
+	return result;
+}
+
+bool Room::planSave(SavePlan& plan){
+	plan.header=header;
+	plan.states=states;
+	plan.scrollHacks.assign(scroll.size(), Handles::NONE);
+	plan.tileHacks.assign(tiles.size(), Handles::NONE);
+	plan.enemyHacks.assign(enemies.size(), Handles::NONE);
+	plan.plmHacks.assign(plm.size(), Handles::NONE);
+	Buffer* data;
+	U32 offset;
+	//header and default state stay where they are, their space claimed first so nothing else is put there
+	plan.offset=headerOffset;
+	plan.blocks.push_back(Block());
+	plan.blocks[0].offset=plan.offset;
+	plan.blocks[0].data.resize(plan.header.size()+State::SIZE);
+	plan.blocks[0].taken=readUsage(*writable, plan.offset, plan.blocks[0].data.size())==Rom::HACKABLE;
+	if(plan.blocks[0].taken) writable->claimSpace(plan.offset, plan.blocks[0].data.size());
 	//stuff that can be shared between states
-	for(unsigned s=0; s<states.size(); ++s){
-		State& state=states[s];
+	for(unsigned s=0; s<plan.states.size(); ++s){
+		State& state=plan.states[s];
+		const Handles& handle=handles[s];
 		//scroll data
-		if(state.scroll>=0x8000u){
-			if(scrollHacks.find(state.scroll)==scrollHacks.end()){
-				if(!rom->takeSpace(State::SCROLL_BANK, scroll[state.scroll].size(), offset))
+		if(handle.scroll!=Handles::NONE){
+			if(plan.scrollHacks[handle.scroll]==Handles::NONE){
+				if(!(data=reserve(plan, State::SCROLL_BANK, State::SCROLL_BANK, scroll[handle.scroll].size(), offset)))
 					return false;
-				scrollHacks[state.scroll]=offset;
-				writeU82D(rom->buffer, offset, scroll[state.scroll]);
+				plan.scrollHacks[handle.scroll]=offset;
+				scroll[handle.scroll].write(*data, 0);
 			}
-			state.scroll=scrollHacks[state.scroll];
+			state.scroll=plan.scrollHacks[handle.scroll];
 		}
 		//tile data
-		if(tileHacks.find(state.tiles)==tileHacks.end()){
-			Buffer buffer;
-			buffer.resize(2);
-			Array2D<Tile>& stateTiles=tiles[state.tiles];
-			writeU16(buffer, 0, 2*stateTiles.readISize()*stateTiles.readJSize());
-			for(unsigned j=0; j<stateTiles.readJSize(); ++j)
-				for(unsigned i=0; i<stateTiles.readISize(); ++i)
-					stateTiles.at(i, j).layer1.write(buffer);
-			for(unsigned j=0; j<stateTiles.readJSize(); ++j)
-				for(unsigned i=0; i<stateTiles.readISize(); ++i)
-					buffer.push_back(stateTiles.at(i, j).bts);
-			if(stateTiles.at(0, 0).hasLayer2)
-				for(unsigned j=0; j<stateTiles.readJSize(); ++j)
-					for(unsigned i=0; i<stateTiles.readISize(); ++i)
-						stateTiles.at(i, j).layer2.write(buffer);
+		if(plan.tileHacks[handle.tiles]==Handles::NONE){
 			Buffer compressed;
-			compress(buffer, compressed);
-			if(!rom->takeSpace(Tile::FIRST_BANK, Tile::LAST_BANK, compressed.size(), offset))
+			if(handle.tiles<compressedTiles.size()&&compressedTiles[handle.tiles].size()) compressed=compressedTiles[handle.tiles];
+			else compressTiles(handle.tiles, compressed);
+			if(!(data=reserve(plan, Tile::FIRST_BANK, Tile::LAST_BANK, compressed.size(), offset)))
 				return false;
-			tileHacks[state.tiles]=offset;
-			for(unsigned i=0; i<compressed.size(); ++i) rom->buffer[offset+i]=compressed[i];
+			plan.tileHacks[handle.tiles]=offset;
+			data->swap(compressed);
 		}
-		state.tiles=tileHacks[state.tiles];
+		state.tiles=plan.tileHacks[handle.tiles];
 		//enemies
-		if(enemies[state.enemies].size()){
-			if(enemyHacks.find(state.enemies)==enemyHacks.end()){
-				if(!rom->takeSpace(Enemy::BANK, enemies[state.enemies].size()*Enemy::SIZE+2, offset))
+		if(handle.enemies!=Handles::NONE&&enemies[handle.enemies].size()){
+			if(plan.enemyHacks[handle.enemies]==Handles::NONE){
+				const vector<Enemy>& stateEnemies=enemies[handle.enemies];
+				if(!(data=reserve(plan, Enemy::BANK, Enemy::BANK, stateEnemies.size()*Enemy::SIZE+2, offset)))
 					return false;
-				enemyHacks[state.enemies]=offset;
-				for(unsigned i=0; i<enemies[state.enemies].size(); ++i){
-					enemies[state.enemies][i].write(rom->buffer, offset);
-					offset+=Enemy::SIZE;
-				}
-				writeU16(rom->buffer, offset, Enemy::SENTINEL);
+				plan.enemyHacks[handle.enemies]=offset;
+				for(unsigned i=0; i<stateEnemies.size(); ++i)
+					stateEnemies[i].write(*data, i*Enemy::SIZE);
+				writeU16(*data, stateEnemies.size()*Enemy::SIZE, Enemy::SENTINEL);
 			}
-			state.enemies=enemyHacks[state.enemies];
+			state.enemies=plan.enemyHacks[handle.enemies];
 		}
 		else state.enemies=0;
 		//post load modifications
-		if(plm[state.plm].size()){
-			if(plmHacks.find(state.plm)==plmHacks.end()){
-				if(!rom->takeSpace(Plm::BANK, plm[state.plm].size()*Plm::SENTINEL+2, offset))
+		if(handle.plm!=Handles::NONE&&plm[handle.plm].size()){
+			if(plan.plmHacks[handle.plm]==Handles::NONE){
+				const vector<Plm>& statePlm=plm[handle.plm];
+				if(!(data=reserve(plan, Plm::BANK, Plm::BANK, statePlm.size()*Plm::SIZE+2, offset)))
 					return false;
-				plmHacks[state.plm]=offset;
-				for(unsigned i=0; i<plm[state.plm].size(); ++i){
-					plm[state.plm][i].write(rom->buffer, offset);
-					offset+=Plm::SIZE;
-				}
-				writeU16(rom->buffer, offset, Plm::SENTINEL);
+				plan.plmHacks[handle.plm]=offset;
+				for(unsigned i=0; i<statePlm.size(); ++i)
+					statePlm[i].write(*data, i*Plm::SIZE);
+				writeU16(*data, statePlm.size()*Plm::SIZE, Plm::SENTINEL);
 			}
-			state.plm=plmHacks[state.plm];
+			state.plm=plan.plmHacks[handle.plm];
 		}
 		else state.plm=0;
-		//state
-		if(header.stateInfo[s].code!=Header::STANDARD){
-			if(!rom->takeSpace(State::BANK, State::SIZE, header.stateInfo[s].state))
-				return false;
-			state.write(rom->buffer, header.stateInfo[s].state);
-		}
+	}
+	//states
+	for(unsigned s=0; s<plan.states.size(); ++s){
+		if(plan.header.stateInfo[s].code==Header::STANDARD) continue;
+		if(!(data=reserve(plan, State::BANK, State::BANK, State::SIZE, plan.header.stateInfo[s].state)))
+			return false;
+		plan.states[s].write(*data, 0);
 	}
 	//doors
-	if(!rom->takeSpace(Header::DOOR_BANK, 2*doors.size(), header.doors))
+	if(!(data=reserve(plan, Header::DOOR_BANK, Header::DOOR_BANK, 2*doors.size(), plan.header.doors)))
 		return false;
 	for(unsigned i=0; i<doors.size(); ++i)
-		writeU16(rom->buffer, header.doors+2*i, offsetToLoRom16(doors[i]));
+		writeU16(*data, 2*i, offsetToLoRom16(doors[i]));
 	//header and default state
-	if(!rom->takeSpace(Header::BANK, header.size()+State::SIZE, offset))
-		return false;
-	header.write(rom->buffer, offset);
-	states.back().write(rom->buffer, offset+header.size());
+	data=&plan.blocks[0].data;
+	plan.header.stateInfo.back().state=plan.offset+plan.header.size();
+	plan.header.write(*data, 0);
+	plan.states.back().write(*data, plan.header.size());
 	//finish
-	rekey(scroll, scrollHacks);
-	rekey(tiles, tileHacks);
-	rekey(enemies, enemyHacks);
-	rekey(plm, plmHacks);
 	return true;
 }
 
+void Room::compressTiles(unsigned handle, Buffer& compressed) const{
+	Buffer buffer;
+	buffer.resize(2);
+	const Array2D<Tile>& stateTiles=tiles[handle];
+	writeU16(buffer, 0, 2*stateTiles.readISize()*stateTiles.readJSize());
+	for(unsigned j=0; j<stateTiles.readJSize(); ++j)
+		for(unsigned i=0; i<stateTiles.readISize(); ++i)
+			stateTiles.at(i, j).layer1.write(buffer);
+	for(unsigned j=0; j<stateTiles.readJSize(); ++j)
+		for(unsigned i=0; i<stateTiles.readISize(); ++i)
+			buffer.push_back(stateTiles.at(i, j).bts);
+	if(stateTiles.at(0, 0).hasLayer2)
+		for(unsigned j=0; j<stateTiles.readJSize(); ++j)
+			for(unsigned i=0; i<stateTiles.readISize(); ++i)
+				stateTiles.at(i, j).layer2.write(buffer);
+	compressed.clear();
+	compress(buffer, compressed);
+}
+
+//takes space for a block of a save plan, returns where to stage the block's data
+Buffer* Room::reserve(SavePlan& plan, U8 minBank, U8 maxBank, unsigned size, U32& offset){
+	if(!writable->takeSpace(minBank, maxBank, size, offset)) return NULL;
+	plan.blocks.push_back(Block());
+	plan.blocks.back().offset=offset;
+	plan.blocks.back().data.resize(size);
+	plan.blocks.back().taken=true;
+	return &plan.blocks.back().data;
+}
+
+void Room::release(const SavePlan& plan){
+	for(unsigned i=0; i<plan.blocks.size(); ++i)
+		if(plan.blocks[i].taken) writable->freeSpace(plan.blocks[i].offset, plan.blocks[i].data.size());
+}
+
+//handle of the data an earlier state shares with state s, or Handles::NONE
+unsigned Room::sharedHandle(unsigned s, U32 State::* pointer, unsigned Handles::* handle) const{
+	for(unsigned i=0; i<s; ++i)
+		if(states[i].*pointer==states[s].*pointer)
+			return handles[i].*handle;
+	return Handles::NONE;
+}
+
 void Room::loadGraphics(){
+	SM_PROFILE_SCOPE("loadGraphics");
 	U32 tileSetPointer=tileSetOffset(states[stateIndex].tileSet);
 	//get palette
 	Buffer buffer;
 	decompress(rom->buffer, loRomToOffset(readU24(rom->buffer, tileSetPointer+6)), &buffer);
-	vector<Color> palette;
+	palette.clear();
 	for(unsigned i=0; i<buffer.size(); i+=2){
 		U16 p=buffer[i+1]<<8|buffer[i];
 		palette.push_back(Color(
@@ -981,7 +1582,7 @@ void Room::loadGraphics(){
 			mode7TileSet[i].resize(TILE_SIZE/2, TILE_SIZE/2);
 			for(unsigned x=0; x<TILE_SIZE/2; ++x)
 				for(unsigned y=0; y<TILE_SIZE/2; ++y)
-					mode7TileSet[i].at(x, y)=palette[buffer[2*(TILE_SIZE/2*TILE_SIZE/2*i+8*y+x)+1]];
+					mode7TileSet[i].at(x, y)=buffer[2*(TILE_SIZE/2*TILE_SIZE/2*i+8*y+x)+1];
 		}
 		buffer.clear();
 		if(states[stateIndex].layerHandling==VANILLA_CERES_RIDLEY_ROOM_LAYER_HANDLING)
@@ -994,40 +1595,15 @@ void Room::loadGraphics(){
 	else buffer.resize(0x5000u);
 	Buffer furtherBuffer;
 	bool loadCommonRoomElements=header.region!=6&&!mode7TileSet.size();
-	if(loadCommonRoomElements) decompress(rom->buffer, 0x1C8000u, &furtherBuffer);//common room elements
+	if(loadCommonRoomElements) decompress(rom->buffer, COMMON_GRAPHICS_OFFSET, &furtherBuffer);
 	for(unsigned i=0; i<furtherBuffer.size(); ++i) buffer.push_back(furtherBuffer[i]);
-	for(unsigned i=0; i<buffer.size(); i+=32){
-		U8 copy[32];
-		for(unsigned j=0; j<32; ++j){
-			copy[j]=buffer[i+j];
-			buffer[i+j]=0;
-		}
-		for(unsigned y=0; y<8; y++){
-			U8 line[4];
-			line[0]=copy[y*2];
-			line[1]=copy[y*2+1];
-			line[2]=copy[y*2+16];
-			line[3]=copy[y*2+17];
-			for(unsigned x=0; x<8; x++){
-				unsigned shift=(7-x)*4;
-				U32 word=0;
-				for(unsigned j=0; j<4; ++j) word+=(line[j]&1)<<(shift+j);
-				for(unsigned j=0; j<4; ++j){
-					buffer[i+y*4+j]|=word>>(8*j)&0xFFu;
-					line[j]>>=1;
-				}
-			}
-		}
-	}
 	Buffer subtiles;
-	for(unsigned i=0; i<buffer.size(); ++i){
-		subtiles.push_back(buffer[i]&0xFu);
-		subtiles.push_back(buffer[i]>>4);
-	}
+	decodeSubtiles(buffer, subtiles);
+	SM_PROFILE_BYTES(subtiles.size());
 	//get tile assemblers
 	vector<TileAssembler> tileAssemblers;
 	buffer.clear();
-	if(loadCommonRoomElements) decompress(rom->buffer, 0x1CA09Du, &buffer);//common room elements
+	if(loadCommonRoomElements) decompress(rom->buffer, COMMON_TILE_TABLE_OFFSET, &buffer);
 	furtherBuffer.clear();
 	decompress(rom->buffer, loRomToOffset(readU24(rom->buffer, tileSetPointer)), &furtherBuffer);
 	for(unsigned i=0; i<furtherBuffer.size(); ++i) buffer.push_back(furtherBuffer[i]);
@@ -1040,23 +1616,30 @@ void Room::loadGraphics(){
 		));
 	}
 	//assemble subtiles into tiles
-	tileSet.resize(tileAssemblers.size());
-	for(unsigned i=0; i<tileAssemblers.size(); ++i){
-		tileSet[i].resize(TILE_SIZE, TILE_SIZE);
-		drawSubtile(subtiles, tileAssemblers[i].ul, palette, tileSet[i], 0          , 0);
-		drawSubtile(subtiles, tileAssemblers[i].ur, palette, tileSet[i], TILE_SIZE/2, 0);
-		drawSubtile(subtiles, tileAssemblers[i].dl, palette, tileSet[i], 0          , TILE_SIZE/2);
-		drawSubtile(subtiles, tileAssemblers[i].dr, palette, tileSet[i], TILE_SIZE/2, TILE_SIZE/2);
-	}
+	assembleTiles(subtiles, tileAssemblers, tileSet);
 }
 
 void Room::drawTileSet(Array2D<Color>& destination, unsigned tilesWide) const{
+	Array2D<U8> indices;
+	drawIndexedTileSet(indices, tilesWide);
+	destination.resize(indices.readISize(), indices.readJSize());
+	for(unsigned i=0; i<indices.readISize(); ++i)
+		for(unsigned j=0; j<indices.readJSize(); ++j){
+			U8 index=indices.at(i, j);
+			destination.at(i, j)=index&&index<palette.size()?palette[index]:Color();
+		}
+}
+
+void Room::drawIndexedTileSet(Array2D<U8>& destination, unsigned tilesWide) const{
 	destination.resize(tilesWide*TILE_SIZE, (tileSet.size()/tilesWide+1)*TILE_SIZE+(mode7TileSet.size()/(tilesWide/2)+1)*TILE_SIZE/2);
+	for(unsigned i=0; i<destination.readISize(); ++i)
+		for(unsigned j=0; j<destination.readJSize(); ++j)
+			destination.at(i, j)=0;
 	for(unsigned i=0; i<tileSet.size(); ++i)
 		for(unsigned x=0; x<TILE_SIZE; ++x)
 			for(unsigned y=0; y<TILE_SIZE; ++y)
 				destination.at(i%tilesWide*TILE_SIZE+x, i/tilesWide*TILE_SIZE+y)=tileSet[i].at(x, y);
-	if(mode7.tiles.readISize())
+	if(mode7.readTiles().readISize())
 		for(unsigned i=0; i<mode7TileSet.size(); ++i)
 			for(unsigned x=0; x<TILE_SIZE/2; ++x)
 				for(unsigned y=0; y<TILE_SIZE/2; ++y)
@@ -1064,21 +1647,23 @@ void Room::drawTileSet(Array2D<Color>& destination, unsigned tilesWide) const{
 }
 
 void Room::getQuadsVertexArray(vector<Vertex>& vertices, unsigned tilesWide, bool showLayer1, bool showLayer2, bool showMode7) const{
+	SM_PROFILE_SCOPE("getQuadsVertexArray");
 	if(showMode7)
-		for(unsigned i=0; i<mode7.tiles.readISize(); ++i)
-			for(unsigned j=0; j<mode7.tiles.readJSize(); ++j){
-				unsigned tileX=mode7.tiles.at(i, j)%(tilesWide*2)*TILE_SIZE/2;
-				unsigned tileY=mode7.tiles.at(i, j)/(tilesWide*2)*TILE_SIZE/2+(tileSet.size()/tilesWide+1)*TILE_SIZE;
+		for(unsigned i=0; i<mode7.readTiles().readISize(); ++i)
+			for(unsigned j=0; j<mode7.readTiles().readJSize(); ++j){
+				unsigned tileX=mode7.readTiles().at(i, j)%(tilesWide*2)*TILE_SIZE/2;
+				unsigned tileY=mode7.readTiles().at(i, j)/(tilesWide*2)*TILE_SIZE/2+(tileSet.size()/tilesWide+1)*TILE_SIZE;
 				unsigned txi=tileX, txf=tileX+TILE_SIZE/2-1, tyi=tileY, tyf=tileY+TILE_SIZE/2-1;
 				vertices.push_back(Vertex((i+0)*TILE_SIZE/2, (j+0)*TILE_SIZE/2, txi, tyi));
 				vertices.push_back(Vertex((i+1)*TILE_SIZE/2, (j+0)*TILE_SIZE/2, txf, tyi));
 				vertices.push_back(Vertex((i+1)*TILE_SIZE/2, (j+1)*TILE_SIZE/2, txf, tyf));
 				vertices.push_back(Vertex((i+0)*TILE_SIZE/2, (j+1)*TILE_SIZE/2, txi, tyf));
 			}
+	const Array2D<Tile>& stateTiles=readStateTiles();
 	if(showLayer2)
-		for(unsigned i=0; i<readStateTiles().readISize(); ++i)
-			for(unsigned j=0; j<readStateTiles().readJSize(); ++j){
-				const Tile& tile=readStateTiles().at(i, j);
+		for(unsigned i=0; i<stateTiles.readISize(); ++i)
+			for(unsigned j=0; j<stateTiles.readJSize(); ++j){
+				const Tile& tile=stateTiles.at(i, j);
 				if(!tile.hasLayer2) continue;
 				unsigned tileX=tile.layer2.index%tilesWide*TILE_SIZE;
 				unsigned tileY=tile.layer2.index/tilesWide*TILE_SIZE;
@@ -1097,9 +1682,9 @@ void Room::getQuadsVertexArray(vector<Vertex>& vertices, unsigned tilesWide, boo
 				vertices.push_back(Vertex((i+0)*TILE_SIZE, (j+1)*TILE_SIZE, txi, tyf));
 			}
 	if(showLayer1)
-		for(unsigned i=0; i<readStateTiles().readISize(); ++i)
-			for(unsigned j=0; j<readStateTiles().readJSize(); ++j){
-				const Tile& tile=readStateTiles().at(i, j);
+		for(unsigned i=0; i<stateTiles.readISize(); ++i)
+			for(unsigned j=0; j<stateTiles.readJSize(); ++j){
+				const Tile& tile=stateTiles.at(i, j);
 				unsigned tileX=tile.layer1.index%tilesWide*TILE_SIZE;
 				unsigned tileY=tile.layer1.index/tilesWide*TILE_SIZE;
 				unsigned txi=tileX, txf=tileX+TILE_SIZE-1, tyi=tileY, tyf=tileY+TILE_SIZE-1;
@@ -1116,6 +1701,22 @@ void Room::getQuadsVertexArray(vector<Vertex>& vertices, unsigned tilesWide, boo
 				vertices.push_back(Vertex((i+1)*TILE_SIZE, (j+1)*TILE_SIZE, txf, tyf));
 				vertices.push_back(Vertex((i+0)*TILE_SIZE, (j+1)*TILE_SIZE, txi, tyf));
 			}
+	SM_PROFILE_BYTES(vertices.size()*sizeof(Vertex));
+}
+
+void Room::drawMode7(Array2D<Color>& destination, const Mode7::Affine* affine) const{
+	Array2D<U8> drawn;
+	const Array2D<U8>* indices=&mode7.readBitmap();
+	if(affine){
+		mode7.drawAffine(drawn, *affine);
+		indices=&drawn;
+	}
+	destination.resize(indices->readISize(), indices->readJSize());
+	for(unsigned i=0; i<indices->readISize(); ++i)
+		for(unsigned j=0; j<indices->readJSize(); ++j){
+			U8 index=indices->at(i, j);
+			destination.at(i, j)=!index||index>=palette.size()?Color():palette[index];
+		}
 }
 
 bool Room::readDoor(unsigned x, unsigned y, Transition& transition){
@@ -1130,12 +1731,725 @@ Header::Code Room::readStateCode(unsigned i) const{
 	return header.stateInfo[i].code;
 }
 
+bool sameLayer(const TileLayer& a, const TileLayer& b){
+	return a.index==b.index&&a.flipH==b.flipH&&a.flipV==b.flipV&&a.property==b.property;
+}
+
+bool sameLayers(const Tile& a, const Tile& b){
+	return sameLayer(a.layer1, b.layer1)&&a.hasLayer2==b.hasLayer2&&(!a.hasLayer2||sameLayer(a.layer2, b.layer2));
+}
+
+bool sm::same(const Tile& a, const Tile& b){
+	return sameLayers(a, b)&&a.bts==b.bts;
+}
+
+bool same(const ScrollMap& a, const ScrollMap& b){ return a==b; }
+
+bool sm::same(const Enemy& a, const Enemy& b){
+	return a.species==b.species&&a.x==b.x&&a.y==b.y
+		&&a.field1==b.field1&&a.field2==b.field2&&a.field3==b.field3&&a.field4==b.field4&&a.field5==b.field5;
+}
+
+bool sm::same(const Plm& a, const Plm& b){
+	return a.type==b.type&&a.x==b.x&&a.y==b.y&&a.field1==b.field1&&a.field2==b.field2;
+}
+
+template<class T> bool same(const Array2D<T>& a, const Array2D<T>& b){
+	if(a.readISize()!=b.readISize()||a.readJSize()!=b.readJSize()) return false;
+	for(unsigned i=0; i<a.readISize(); ++i)
+		for(unsigned j=0; j<a.readJSize(); ++j)
+			if(!same(a.at(i, j), b.at(i, j))) return false;
+	return true;
+}
+
+template<class T> bool same(const vector<T>& a, const vector<T>& b){
+	if(a.size()!=b.size()) return false;
+	for(unsigned i=0; i<a.size(); ++i)
+		if(!same(a[i], b[i])) return false;
+	return true;
+}
+
+//compares what handles a and b refer to, a handle of NONE only matching NONE
+template<class T> bool sameHandled(const vector<T>& a, unsigned handleA, const vector<T>& b, unsigned handleB, unsigned none){
+	if(handleA==none||handleB==none) return handleA==handleB;
+	return same(a[handleA], b[handleB]);
+}
+
+//number of elements that don't match, elements only one list has included
+template<class T> unsigned countDifferent(const vector<T>& a, const vector<T>& b){
+	unsigned common=min(a.size(), b.size()), result=max(a.size(), b.size())-common;
+	for(unsigned i=0; i<common; ++i)
+		if(!same(a[i], b[i])) ++result;
+	return result;
+}
+
+//map location, size, scrolling and graphics flags -- not doors or states
+bool sameLayout(const Header& a, const Header& b){
+	return a.index==b.index&&a.region==b.region&&a.x==b.x&&a.y==b.y&&a.width==b.width&&a.height==b.height
+		&&a.upScroll==b.upScroll&&a.downScroll==b.downScroll&&a.graphicsFlags==b.graphicsFlags;
+}
+
+bool sameCondition(const Header::StateInfo& a, const Header::StateInfo& b){
+	if(a.code!=b.code) return false;
+	for(unsigned i=0; i<Header::fieldSize(a.code); ++i)
+		if(a.fields[i]!=b.fields[i]) return false;
+	return true;
+}
+
+//everything but pointers to level data, scroll, enemies and post load modifications
+bool sameSettings(const State& a, const State& b){
+	return a.tileSet==b.tileSet&&a.musicTrack==b.musicTrack&&a.musicControl==b.musicControl&&a.fx1==b.fx1&&a.enemySet==b.enemySet
+		&&a.layer2==b.layer2&&a.unknown==b.unknown&&a.fx2==b.fx2&&a.background==b.background&&a.layerHandling==b.layerHandling;
+}
+
+void countTileDifferences(const Array2D<Tile>& a, const Array2D<Tile>& b, unsigned& tiles, unsigned& bts){
+	unsigned w=max(a.readISize(), b.readISize()), h=max(a.readJSize(), b.readJSize());
+	for(unsigned i=0; i<w; ++i)
+		for(unsigned j=0; j<h; ++j){
+			if(i>=a.readISize()||j>=a.readJSize()||i>=b.readISize()||j>=b.readJSize()){
+				++tiles;
+				++bts;
+				continue;
+			}
+			if(!sameLayers(a.at(i, j), b.at(i, j))) ++tiles;
+			if(a.at(i, j).bts!=b.at(i, j).bts) ++bts;
+		}
+}
+
+string Room::compare(const Room& other) const{
+	stringstream ss;
+	if(doors!=other.doors) ss<<"doors differ";
+	else if(states.size()!=other.states.size()) ss<<"number of states differs";
+	else for(unsigned s=0; s<states.size(); ++s){
+		const Handles& a=handles[s];
+		const Handles& b=other.handles[s];
+		if(!sameHandled(scroll, a.scroll, other.scroll, b.scroll, Handles::NONE)||(a.scroll==Handles::NONE&&states[s].scroll!=other.states[s].scroll))
+			ss<<"state "<<s<<": scroll differs";
+		else if(!sameHandled(tiles, a.tiles, other.tiles, b.tiles, Handles::NONE))
+			ss<<"state "<<s<<": tiles differ";
+		else if(!sameHandled(enemies, a.enemies, other.enemies, b.enemies, Handles::NONE))
+			ss<<"state "<<s<<": enemies differ";
+		else if(!sameHandled(plm, a.plm, other.plm, b.plm, Handles::NONE))
+			ss<<"state "<<s<<": post load modifications differ";
+		else continue;
+		break;
+	}
+	return ss.str();
+}
+
+Room::Differences Room::countDifferences(const Room& other) const{
+	static const vector<Enemy> noEnemies;
+	static const vector<Plm> noPlm;
+	Differences result;
+	result.header=!sameLayout(header, other.header);
+	result.doors=max(doors.size(), other.doors.size())-min(doors.size(), other.doors.size());
+	unsigned common=min(states.size(), other.states.size());
+	result.states=max(states.size(), other.states.size())-common;
+	for(unsigned s=0; s<common; ++s){
+		const Handles& a=handles[s];
+		const Handles& b=other.handles[s];
+		if(!sameCondition(header.stateInfo[s], other.header.stateInfo[s])||!sameSettings(states[s], other.states[s])) ++result.states;
+		countTileDifferences(tiles[a.tiles], other.tiles[b.tiles], result.tiles, result.bts);
+		result.enemies+=countDifferent(a.enemies==Handles::NONE?noEnemies:enemies[a.enemies], b.enemies==Handles::NONE?noEnemies:other.enemies[b.enemies]);
+		result.plm+=countDifferent(a.plm==Handles::NONE?noPlm:plm[a.plm], b.plm==Handles::NONE?noPlm:other.plm[b.plm]);
+		//screens, a constant scroll value standing for every screen
+		unsigned w=max(header.width, other.header.width), h=max(header.height, other.header.height);
+		for(unsigned i=0; i<w; ++i)
+			for(unsigned j=0; j<h; ++j){
+				if(i>=header.width||j>=header.height||i>=other.header.width||j>=other.header.height) ++result.scroll;
+				else if(
+					(a.scroll==Handles::NONE?states[s].scroll:scroll[a.scroll].readScreen(i, j))!=
+					(b.scroll==Handles::NONE?other.states[s].scroll:other.scroll[b.scroll].readScreen(i, j))
+				) ++result.scroll;
+			}
+	}
+	return result;
+}
+
+bool Room::setTile(unsigned i, unsigned j, const Tile& tile){
+	unsigned handle=handles[stateIndex].tiles;
+	if(i>=tiles[handle].readISize()||j>=tiles[handle].readJSize()) return false;
+	tiles[handle].at(i, j)=tile;
+	if(handle<compressedTiles.size()) compressedTiles[handle].clear();
+	return true;
+}
+
+const ScrollMap& Room::readScroll() const{
+	unsigned handle=handles[stateIndex].scroll;
+	return handle==Handles::NONE?constantScroll[states[stateIndex].scroll]:scroll[handle];
+}
+
+const vector<Enemy>& Room::readEnemies() const{
+	static const vector<Enemy> none;
+	unsigned handle=handles[stateIndex].enemies;
+	return handle==Handles::NONE?none:enemies[handle];
+}
+
+bool Room::setEnemy(unsigned i, const Enemy& enemy){
+	unsigned& handle=handles[stateIndex].enemies;
+	if(handle==Handles::NONE){
+		if(i) return false;
+		handle=enemies.size();
+		enemies.push_back(vector<Enemy>());
+	}
+	vector<Enemy>& stateEnemies=enemies[handle];
+	if(i>stateEnemies.size()) return false;
+	if(i==stateEnemies.size()) stateEnemies.push_back(enemy);
+	else stateEnemies[i]=enemy;
+	return true;
+}
+
+const vector<Plm>& Room::readPlm() const{
+	static const vector<Plm> none;
+	unsigned handle=handles[stateIndex].plm;
+	return handle==Handles::NONE?none:plm[handle];
+}
+
+bool Room::setPlm(unsigned i, const Plm& p){
+	unsigned& handle=handles[stateIndex].plm;
+	if(handle==Handles::NONE){
+		if(i) return false;
+		handle=plm.size();
+		plm.push_back(vector<Plm>());
+	}
+	vector<Plm>& statePlm=plm[handle];
+	if(i>statePlm.size()) return false;
+	if(i==statePlm.size()) statePlm.push_back(p);
+	else statePlm[i]=p;
+	return true;
+}
+
+bool Room::setDoor(unsigned i, U32 transition){
+	if(i>doors.size()) return false;
+	if(i==doors.size()) doors.push_back(transition);
+	else doors[i]=transition;
+	return true;
+}
+
+unsigned Room::prepareSave(){
+	compressedTiles.resize(tiles.size());
+	unsigned size=0;
+	for(unsigned s=0; s<states.size(); ++s){
+		Buffer& compressed=compressedTiles[handles[s].tiles];
+		if(compressed.empty()){
+			compressTiles(handles[s].tiles, compressed);
+			size+=compressed.size();
+		}
+	}
+	return size;
+}
+
 bool Room::convertScreenToTile(unsigned& x, unsigned& y) const{
 	x/=TILE_SIZE;
 	y/=TILE_SIZE;
 	return x<readStateTiles().readISize()&&y<readStateTiles().readJSize();
 }
 
+//grows buffer by size bytes starting at a multiple of 4, returning where they start
+U32 appendAligned(Buffer& buffer, unsigned size){
+	U32 offset=(buffer.size()+3)&~3u;
+	buffer.resize(offset+size, 0);
+	return offset;
+}
+
+U16 packTileLayer(const TileLayer& layer){
+	return layer.index|(layer.flipH?0x400u:0)|(layer.flipV?0x800u:0)|layer.property<<12;
+}
+
+void Room::writeBundle(Buffer& bundle) const{
+	U32 room=appendAligned(bundle, Bundle::ROOM_SIZE);
+	writeU32(bundle, room, headerOffset);
+	bundle[room+4]=header.index;
+	bundle[room+5]=header.region;
+	bundle[room+6]=header.x;
+	bundle[room+7]=header.y;
+	bundle[room+8]=header.width;
+	bundle[room+9]=header.height;
+	bundle[room+10]=header.upScroll;
+	bundle[room+11]=header.downScroll;
+	bundle[room+12]=header.graphicsFlags;
+	U32 statesOffset=appendAligned(bundle, states.size()*Bundle::STATE_SIZE);
+	writeU32(bundle, room+16, states.size());
+	writeU32(bundle, room+20, statesOffset);
+	U32 doorsOffset=appendAligned(bundle, 4*doors.size());
+	writeU32(bundle, room+24, doors.size());
+	writeU32(bundle, room+28, doorsOffset);
+	for(unsigned i=0; i<doors.size(); ++i) writeU32(bundle, doorsOffset+4*i, doors[i]);
+	//sections by handle, written the first time a state uses them
+	vector<U32> scrollSections(scroll.size(), 0), tileSections(tiles.size(), 0), btsSections(tiles.size(), 0), enemySections(enemies.size(), 0), plmSections(plm.size(), 0);
+	U32 constantScrollSections[3]={0, 0, 0}, noEnemySection=0, noPlmSection=0;
+	static const vector<Enemy> noEnemies;
+	static const vector<Plm> noPlm;
+	unsigned screens=header.width*header.height;
+	for(unsigned s=0; s<states.size(); ++s){
+		const State& state=states[s];
+		const Handles& handle=handles[s];
+		U32 record=statesOffset+s*Bundle::STATE_SIZE;
+		writeU16(bundle, record, header.stateInfo[s].code);
+		bundle[record+2]=header.stateInfo[s].fields[0];
+		bundle[record+3]=header.stateInfo[s].fields[1];
+		writeU32(bundle, record+4, header.stateInfo[s].state);
+		bundle[record+8]=state.tileSet;
+		bundle[record+9]=state.musicTrack;
+		bundle[record+10]=state.musicControl;
+		const Array2D<Tile>& stateTiles=tiles[handle.tiles];
+		unsigned n=stateTiles.size();
+		bool hasLayer2=n&&stateTiles.at(0, 0).hasLayer2;
+		bundle[record+11]=hasLayer2;
+		writeU16(bundle, record+12, state.fx1);
+		writeU16(bundle, record+14, state.enemySet);
+		writeU16(bundle, record+16, state.layer2);
+		writeU16(bundle, record+18, state.unknown);
+		writeU16(bundle, record+20, state.fx2);
+		writeU16(bundle, record+22, state.background);
+		writeU16(bundle, record+24, state.layerHandling);
+		//tiles
+		writeU32(bundle, record+28, stateTiles.readISize());
+		writeU32(bundle, record+32, stateTiles.readJSize());
+		U32& tileSection=tileSections[handle.tiles];
+		if(!tileSection){
+			tileSection=appendAligned(bundle, (hasLayer2?4:2)*n);
+			U32 bts=btsSections[handle.tiles]=appendAligned(bundle, n);
+			for(unsigned i=0; i<stateTiles.readISize(); ++i)
+				for(unsigned j=0; j<stateTiles.readJSize(); ++j){
+					const Tile& tile=stateTiles.at(i, j);
+					unsigned k=i+j*stateTiles.readISize();
+					writeU16(bundle, tileSection+2*k, packTileLayer(tile.layer1));
+					if(hasLayer2) writeU16(bundle, tileSection+2*n+2*k, packTileLayer(tile.layer2));
+					bundle[bts+k]=tile.bts;
+				}
+		}
+		writeU32(bundle, record+36, tileSection);
+		writeU32(bundle, record+40, hasLayer2?tileSection+2*n:0);
+		writeU32(bundle, record+44, btsSections[handle.tiles]);
+		//scroll
+		U32* scrollSection=handle.scroll==Handles::NONE?&constantScrollSections[state.scroll]:&scrollSections[handle.scroll];
+		if(!*scrollSection){
+			*scrollSection=appendAligned(bundle, screens);
+			for(unsigned i=0; i<header.width; ++i)
+				for(unsigned j=0; j<header.height; ++j)
+					bundle[*scrollSection+i+j*header.width]=handle.scroll==Handles::NONE?state.scroll:scroll[handle.scroll].readScreen(i, j);
+		}
+		writeU32(bundle, record+48, *scrollSection);
+		//enemies and plm, states without any share one sentinel
+		const vector<Enemy>& stateEnemies=handle.enemies==Handles::NONE?noEnemies:enemies[handle.enemies];
+		U32& enemySection=handle.enemies==Handles::NONE?noEnemySection:enemySections[handle.enemies];
+		if(!enemySection){
+			enemySection=appendAligned(bundle, (stateEnemies.size()+1)*Enemy::SIZE);
+			for(unsigned i=0; i<stateEnemies.size(); ++i) stateEnemies[i].write(bundle, enemySection+i*Enemy::SIZE);
+			writeU16(bundle, enemySection+stateEnemies.size()*Enemy::SIZE, Enemy::SENTINEL);
+		}
+		writeU32(bundle, record+52, stateEnemies.size());
+		writeU32(bundle, record+56, enemySection);
+		const vector<Plm>& statePlm=handle.plm==Handles::NONE?noPlm:plm[handle.plm];
+		U32& plmSection=handle.plm==Handles::NONE?noPlmSection:plmSections[handle.plm];
+		if(!plmSection){
+			plmSection=appendAligned(bundle, (statePlm.size()+1)*Plm::SIZE);
+			for(unsigned i=0; i<statePlm.size(); ++i) statePlm[i].write(bundle, plmSection+i*Plm::SIZE);
+			writeU16(bundle, plmSection+statePlm.size()*Plm::SIZE, Plm::SENTINEL);
+		}
+		writeU32(bundle, record+60, statePlm.size());
+		writeU32(bundle, record+64, plmSection);
+	}
+}
+
+//=====class RoomEdits=====//
+RoomEdits::Edit& RoomEdits::add(Edit::Kind kind, U32 room, unsigned state, unsigned i){
+	edits.push_back(Edit());
+	Edit& edit=edits.back();
+	edit.kind=kind;
+	edit.room=room;
+	edit.state=state;
+	edit.i=i;
+	edit.j=0;
+	edit.transition=0;
+	return edit;
+}
+
+void RoomEdits::setTile(U32 room, unsigned state, unsigned i, unsigned j, const Tile& tile){
+	Edit& edit=add(Edit::TILE, room, state, i);
+	edit.j=j;
+	edit.tile=tile;
+}
+
+void RoomEdits::setEnemy(U32 room, unsigned state, unsigned i, const Enemy& enemy){
+	add(Edit::ENEMY, room, state, i).enemy=enemy;
+}
+
+void RoomEdits::setPlm(U32 room, unsigned state, unsigned i, const Plm& p){
+	add(Edit::PLM, room, state, i).plm=p;
+}
+
+void RoomEdits::setDoor(U32 room, unsigned i, U32 transition){
+	add(Edit::DOOR, room, 0, i).transition=transition;
+}
+
+bool editRoomBefore(const RoomEdits::Edit& a, const RoomEdits::Edit& b){ return a.room<b.room; }
+
+//opens, edits and compresses every step-th room from first -- edits are sorted by room, starts[r] is where room r's begin
+void editRooms(vector<Room>* rooms, const vector<RoomEdits::Edit>* edits, const vector<unsigned>* starts, vector<unsigned>* sizes, vector<char>* ok, unsigned first, unsigned step){
+	for(unsigned r=first; r<rooms->size(); r+=step){
+		Room& room=(*rooms)[r];
+		char& result=(*ok)[r];
+		result=room.open((*edits)[(*starts)[r]].room);
+		for(unsigned e=(*starts)[r]; result&&e<(*starts)[r+1]; ++e){
+			const RoomEdits::Edit& edit=(*edits)[e];
+			if(edit.state>=room.readStates()){
+				result=false;
+				break;
+			}
+			room.setState(edit.state);
+			switch(edit.kind){
+				case RoomEdits::Edit::TILE : result=room.setTile(edit.i, edit.j, edit.tile); break;
+				case RoomEdits::Edit::ENEMY: result=room.setEnemy(edit.i, edit.enemy); break;
+				case RoomEdits::Edit::PLM  : result=room.setPlm(edit.i, edit.plm); break;
+				case RoomEdits::Edit::DOOR : result=room.setDoor(edit.i, edit.transition); break;
+			}
+		}
+		if(result) (*sizes)[r]=room.prepareSave();
+	}
+}
+
+bool RoomEdits::apply(vector<U32>* failed, unsigned threads){
+	if(!threads) threads=max(thread::hardware_concurrency(), 1u);
+	//group edits by room, keeping each room's edits in order
+	vector<Edit> sorted(edits);
+	stable_sort(sorted.begin(), sorted.end(), editRoomBefore);
+	vector<unsigned> starts;
+	for(unsigned e=0; e<sorted.size(); ++e)
+		if(!e||sorted[e].room!=sorted[e-1].room) starts.push_back(e);
+	starts.push_back(sorted.size());
+	//open, edit and compress
+	vector<Room> rooms(starts.size()-1, Room(*rom));
+	vector<unsigned> sizes(rooms.size(), 0);
+	vector<char> ok(rooms.size(), 0);
+	vector<thread> workers;
+	for(unsigned t=1; t<threads; ++t)
+		workers.push_back(thread(editRooms, &rooms, &sorted, &starts, &sizes, &ok, t, threads));
+	editRooms(&rooms, &sorted, &starts, &sizes, &ok, 0, threads);
+	for(unsigned t=0; t<workers.size(); ++t) workers[t].join();
+	//headers are rewritten in place, so they're claimed before any room's data can be put where another's header is
+	for(unsigned r=0; r<rooms.size(); ++r){
+		if(!ok[r]) continue;
+		U32 offset=sorted[starts[r]].room;
+		unsigned size=Header(rom->buffer, offset).size()+State::SIZE;
+		if(readUsage(*rom, offset, size)==Rom::HACKABLE) rom->claimSpace(offset, size);
+	}
+	//save, largest level data first
+	vector<pair<unsigned, unsigned> > order;//size, room
+	for(unsigned r=0; r<rooms.size(); ++r) order.push_back(make_pair(sizes[r], r));
+	sort(order.rbegin(), order.rend());
+	bool result=true;
+	for(unsigned o=0; o<order.size(); ++o){
+		unsigned r=order[o].second;
+		U32 offset;
+		if(ok[r]&&rooms[r].save(offset)) continue;
+		result=false;
+		if(failed) failed->push_back(sorted[starts[r]].room);
+	}
+	return result;
+}
+
+//=====class Bundle=====//
+const U32 Bundle::VERSION;
+const unsigned Bundle::HEADER_SIZE;
+const unsigned Bundle::ROOM_SIZE;
+const unsigned Bundle::STATE_SIZE;
+
+bool Bundle::write(const Rom& rom, Buffer& bundle){
+	SM_PROFILE_SCOPE("Bundle::write");
+	bundle.assign(HEADER_SIZE+4*rom.rooms.size(), 0);
+	const char magic[]="SMRB";
+	for(unsigned i=0; i<4; ++i) bundle[i]=magic[i];
+	writeU32(bundle, 4, VERSION);
+	writeU32(bundle, 8, rom.rooms.size());
+	Room room(rom);
+	for(unsigned i=0; i<rom.rooms.size(); ++i){
+		if(!room.open(rom.rooms.readOffset(i))) return false;
+		writeU32(bundle, HEADER_SIZE+4*i, (bundle.size()+3)&~3u);
+		room.writeBundle(bundle);
+	}
+	SM_PROFILE_BYTES(bundle.size());
+	return true;
+}
+
+//=====class BundleView=====//
+//true if bytes at offset are within size
+bool within(U32 size, U32 offset, U32 bytes){ return offset<=size&&bytes<=size-offset; }
+
+bool BundleView::check() const{
+	if(!within(size, 0, Bundle::HEADER_SIZE)) return false;
+	if(readU8(0)!='S'||readU8(1)!='M'||readU8(2)!='R'||readU8(3)!='B'||readVersion()!=Bundle::VERSION) return false;
+	if(readRooms()>size/4||!within(size, Bundle::HEADER_SIZE, 4*readRooms())) return false;
+	for(unsigned r=0; r<readRooms(); ++r){
+		if(!within(size, readU32(Bundle::HEADER_SIZE+4*r), Bundle::ROOM_SIZE)) return false;
+		BundleRoomView room=readRoom(r);
+		if(room.readStates()>size/Bundle::STATE_SIZE||!within(size, room.readU32(20), room.readStates()*Bundle::STATE_SIZE)) return false;
+		if(room.readDoors()>size/4||!within(size, room.readU32(28), 4*room.readDoors())) return false;
+		for(unsigned s=0; s<room.readStates(); ++s){
+			BundleStateView state=room.readState(s);
+			U32 w=state.readTilesWide(), h=state.readTilesHigh();
+			if(w%SCREEN_SIZE||h%SCREEN_SIZE||w>0xFFu*SCREEN_SIZE||h>0xFFu*SCREEN_SIZE) return false;
+			U32 n=w*h;
+			if(!within(size, state.readU32(36), 2*n)||(state.readHasLayer2()&&!within(size, state.readU32(40), 2*n))||!within(size, state.readU32(44), n)) return false;
+			if(!within(size, state.readU32(48), n/(SCREEN_SIZE*SCREEN_SIZE))) return false;
+			if(state.readEnemies()>size/Enemy::SIZE||!within(size, state.readU32(56), (state.readEnemies()+1)*Enemy::SIZE)) return false;
+			if(state.readPlms()>size/Plm::SIZE||!within(size, state.readU32(64), (state.readPlms()+1)*Plm::SIZE)) return false;
+		}
+	}
+	return true;
+}
+
+//=====class BundleStateView=====//
+//tile layer packed as in level data
+TileLayer unpackLayer(U16 packed){
+	TileLayer layer;
+	layer.index=packed&0x3FFu;
+	layer.flipH=packed&0x400u;
+	layer.flipV=packed&0x800u;
+	layer.property=packed>>12;
+	return layer;
+}
+
+Tile BundleStateView::readTile(unsigned i, unsigned j) const{
+	unsigned k=i+j*readTilesWide();
+	Tile tile;
+	tile.layer1=unpackLayer(View(bytes, readU32(36)).readU16(2*k));
+	tile.hasLayer2=readHasLayer2();
+	if(tile.hasLayer2) tile.layer2=unpackLayer(View(bytes, readU32(40)).readU16(2*k));
+	tile.bts=bytes[readU32(44)+k];
+	return tile;
+}
+
+//=====class DoorGraph=====//
+void readRoomDoors(Rom* rom, vector<vector<U32> >* doors, vector<char>* opened, unsigned start, unsigned end, unsigned step){
+	Room room(*rom);
+	for(unsigned i=start; i<end; i+=step){
+		(*opened)[i]=room.open(rom->rooms.readOffset(i));
+		(*doors)[i]=room.readDoors();
+	}
+}
+
+bool DoorGraph::build(Rom& rom, unsigned threads){
+	if(!threads) threads=max(thread::hardware_concurrency(), 1u);
+	//read doors of each room, spread across threads, until no new rooms turn up
+	vector<vector<U32> > doors;
+	vector<char> opened;
+	for(unsigned read=0; read<rom.rooms.size(); ){
+		unsigned end=rom.rooms.size();
+		doors.resize(end);
+		opened.resize(end);
+		vector<thread> workers;
+		for(unsigned t=1; t<threads; ++t)
+			workers.push_back(thread(readRoomDoors, &rom, &doors, &opened, read+t, end, threads));
+		readRoomDoors(&rom, &doors, &opened, read, end, threads);
+		for(unsigned t=0; t<workers.size(); ++t) workers[t].join();
+		for(unsigned i=read; i<end; ++i){
+			if(!opened[i]) return false;
+			for(unsigned j=0; j<doors[i].size(); ++j){
+				U32 room=TransitionView(rom.buffer, doors[i][j]).readRoom();
+				if(room) rom.rooms.add(room);
+			}
+		}
+		read=end;
+	}
+	//edges
+	first.resize(rom.rooms.size()+1);
+	edges.clear();
+	for(unsigned i=0; i<rom.rooms.size(); ++i){
+		first[i]=edges.size();
+		for(unsigned j=0; j<doors[i].size(); ++j){
+			TransitionView transition(rom.buffer, doors[i][j]);
+			Edge edge;
+			edge.transition=doors[i][j];
+			edge.room=rom.rooms.find(transition.readRoom());
+			edge.direction=transition.readDirection();
+			edge.flags=transition.readFlags();
+			edges.push_back(edge);
+		}
+	}
+	first.back()=edges.size();
+	return true;
+}
+
+//=====class DoorValidator=====//
+DoorValidator::DoorValidator(const DoorGraph& graph): graph(&graph){
+	destinations.resize(graph.readEdges());
+	for(unsigned i=0; i<destinations.size(); ++i) destinations[i]=graph.readEdge(i).room;
+	reached.resize(graph.readRooms());
+	queue.reserve(graph.readRooms());
+}
+
+unsigned DoorValidator::search(const Seed& seed, U16 start){
+	apply(seed);
+	reached.assign(reached.size(), 0);
+	queue.clear();
+	queue.push_back(start);
+	reached[start]=1;
+	for(unsigned i=0; i<queue.size(); ++i){
+		U16 room=queue[i];
+		for(unsigned e=graph->readEdgeIndex(room, 0), end=e+graph->readDoors(room); e<end; ++e){
+			U16 destination=destinations[e];
+			if(destination==RoomRegistry::NONE||reached[destination]) continue;
+			reached[destination]=1;
+			queue.push_back(destination);
+		}
+	}
+	return queue.size();
+}
+
+bool DoorValidator::connects(const Seed& seed, U16 from, U16 to){
+	search(seed, from);
+	return reached[to];
+}
+
+void validateSeeds(const DoorGraph* graph, const vector<DoorValidator::Seed>* seeds, U16 start, const vector<U16>* required, vector<char>* results, unsigned first, unsigned step){
+	DoorValidator validator(*graph);
+	for(unsigned i=first; i<seeds->size(); i+=step){
+		validator.search((*seeds)[i], start);
+		(*results)[i]=1;
+		for(unsigned j=0; j<required->size(); ++j)
+			if(!validator.readReached((*required)[j])){
+				(*results)[i]=0;
+				break;
+			}
+	}
+}
+
+void DoorValidator::validate(const DoorGraph& graph, const vector<Seed>& seeds, U16 start, const vector<U16>& required, vector<char>& results, unsigned threads){
+	if(!threads) threads=max(thread::hardware_concurrency(), 1u);
+	results.resize(seeds.size());
+	vector<thread> workers;
+	for(unsigned t=1; t<threads; ++t)
+		workers.push_back(thread(validateSeeds, &graph, &seeds, start, &required, &results, t, threads));
+	validateSeeds(&graph, &seeds, start, &required, &results, 0, threads);
+	for(unsigned t=0; t<workers.size(); ++t) workers[t].join();
+}
+
+//undoes the previous seed's rewiring and applies seed's
+void DoorValidator::apply(const Seed& seed){
+	for(unsigned i=0; i<rewired.size(); ++i) destinations[rewired[i]]=graph->readEdge(rewired[i]).room;
+	rewired.clear();
+	for(unsigned i=0; i<seed.size(); ++i){
+		unsigned e=graph->readEdgeIndex(seed[i].room, seed[i].door);
+		destinations[e]=seed[i].destination;
+		rewired.push_back(e);
+	}
+}
+
+//=====class RomDiff=====//
+//true if size bytes at offsetA in a match those at offsetB in b
+bool sameBytes(const Buffer& a, U32 offsetA, const Buffer& b, U32 offsetB, unsigned size){
+	return within(a.size(), offsetA, size)&&within(b.size(), offsetB, size)&&(!size||!memcmp(&a[offsetA], &b[offsetB], size));
+}
+
+//lists read in place compared up to their sentinels, a pointer of 0 only matching 0
+template<class V> bool sameList(const Buffer& bufferA, U32 a, const Buffer& bufferB, U32 b, unsigned elementSize){
+	if(!a||!b) return a==b;
+	V viewA(bufferA, a), viewB(bufferB, b);
+	for(; !viewA.atEnd()&&!viewB.atEnd(); viewA=viewA.next(), viewB=viewB.next())
+		if(!sameBytes(bufferA, viewA.readOffset(), bufferB, viewB.readOffset(), elementSize)) return false;
+	return viewA.atEnd()&&viewB.atEnd();
+}
+
+//headers, states and the level data, scroll, enemies and post load modifications they point to match byte for byte
+//pointers aside, so a room that was only moved still matches -- doors are left to the door graphs
+bool sameRoomBytes(const Rom& a, U32 offsetA, const Rom& b, U32 offsetB){
+	Header headerA(a.buffer, offsetA), headerB(b.buffer, offsetB);
+	if(!sameLayout(headerA, headerB)||headerA.stateInfo.size()!=headerB.stateInfo.size()) return false;
+	for(unsigned s=0; s<headerA.stateInfo.size(); ++s){
+		if(!sameCondition(headerA.stateInfo[s], headerB.stateInfo[s])) return false;
+		State stateA(a.buffer, headerA.stateInfo[s].state), stateB(b.buffer, headerB.stateInfo[s].state);
+		if(!sameSettings(stateA, stateB)) return false;
+		if(stateA.scroll<0x8000u||stateB.scroll<0x8000u){
+			if(stateA.scroll!=stateB.scroll) return false;
+		}
+		else if(!sameBytes(a.buffer, stateA.scroll, b.buffer, stateB.scroll, headerA.width*headerA.height)) return false;
+		//compressed level data, without decompressing it
+		unsigned compressed=decompress(a.buffer, stateA.tiles);
+		if(decompress(b.buffer, stateB.tiles)!=compressed||!sameBytes(a.buffer, stateA.tiles, b.buffer, stateB.tiles, compressed)) return false;
+		if(!sameList<EnemyView>(a.buffer, stateA.enemies, b.buffer, stateB.enemies, Enemy::SIZE)) return false;
+		if(!sameList<PlmView>(a.buffer, stateA.plm, b.buffer, stateB.plm, Plm::SIZE)) return false;
+	}
+	return true;
+}
+
+void diffRooms(const Rom* a, const Rom* b, const DoorGraph* graphs, const vector<U16>* partners, vector<RomDiff::Pair>* pairs, unsigned first, unsigned step){
+	Room roomA(*a), roomB(*b);
+	for(unsigned i=first; i<pairs->size(); i+=step){
+		RomDiff::Pair& pair=(*pairs)[i];
+		if(pair.a==RoomRegistry::NONE||pair.b==RoomRegistry::NONE) continue;
+		U32 offsetA=a->rooms.readOffset(pair.a), offsetB=b->rooms.readOffset(pair.b);
+		pair.bytesSame=sameRoomBytes(*a, offsetA, *b, offsetB);
+		if(!pair.bytesSame){
+			roomA.open(offsetA);
+			roomB.open(offsetB);
+			pair.differences=roomA.countDifferences(roomB);
+		}
+		//transitions, destinations compared through the pairing
+		unsigned doors=min(graphs[0].readDoors(pair.a), graphs[1].readDoors(pair.b));
+		for(unsigned d=0; d<doors; ++d){
+			const DoorGraph::Edge& edgeA=graphs[0].readDoor(pair.a, d);
+			const DoorGraph::Edge& edgeB=graphs[1].readDoor(pair.b, d);
+			bool sameDestination=edgeA.room==RoomRegistry::NONE?edgeB.room==RoomRegistry::NONE:partners[0][edgeA.room]==edgeB.room;
+			if(!sameDestination||!sameBytes(a->buffer, edgeA.transition+2, b->buffer, edgeB.transition+2, Transition::SIZE-2))
+				++pair.differences.doors;
+		}
+	}
+}
+
+bool RomDiff::build(Rom& a, Rom& b, unsigned threads){
+	if(!threads) threads=max(thread::hardware_concurrency(), 1u);
+	pairs.clear();
+	if(!graphs[0].build(a, threads)||!graphs[1].build(b, threads)) return false;
+	partners[0].assign(a.rooms.size(), RoomRegistry::NONE);
+	partners[1].assign(b.rooms.size(), RoomRegistry::NONE);
+	//same header offset
+	vector<U16> queue;
+	for(unsigned i=0; i<a.rooms.size(); ++i){
+		U16 j=b.rooms.find(a.rooms.readOffset(i));
+		if(j==RoomRegistry::NONE) continue;
+		partners[0][i]=j;
+		partners[1][j]=i;
+		queue.push_back(i);
+	}
+	//same door out of paired rooms, spreading outward
+	vector<char> byDoors(a.rooms.size(), 0);
+	for(unsigned q=0; q<queue.size(); ++q){
+		U16 i=queue[q], j=partners[0][i];
+		unsigned doors=min(graphs[0].readDoors(i), graphs[1].readDoors(j));
+		for(unsigned d=0; d<doors; ++d){
+			U16 toA=graphs[0].readDoor(i, d).room, toB=graphs[1].readDoor(j, d).room;
+			if(toA==RoomRegistry::NONE||toB==RoomRegistry::NONE||partners[0][toA]!=RoomRegistry::NONE||partners[1][toB]!=RoomRegistry::NONE) continue;
+			partners[0][toA]=toB;
+			partners[1][toB]=toA;
+			byDoors[toA]=1;
+			queue.push_back(toA);
+		}
+	}
+	//pairs, then rooms only b has
+	for(unsigned i=0; i<a.rooms.size(); ++i){
+		Pair pair;
+		pair.a=i;
+		pair.b=partners[0][i];
+		pair.byDoors=byDoors[i];
+		pairs.push_back(pair);
+	}
+	for(unsigned j=0; j<b.rooms.size(); ++j){
+		if(partners[1][j]!=RoomRegistry::NONE) continue;
+		Pair pair;
+		pair.b=j;
+		pairs.push_back(pair);
+	}
+	//compare, spread across threads
+	vector<thread> workers;
+	for(unsigned t=1; t<threads; ++t)
+		workers.push_back(thread(diffRooms, &a, &b, graphs, partners, &pairs, t, threads));
+	diffRooms(&a, &b, graphs, partners, &pairs, 0, threads);
+	for(unsigned t=0; t<workers.size(); ++t) workers[t].join();
+	return true;
+}
+
 //=====functions=====//
 string sm::musicControlDescription(U8 musicControl){
 	switch(musicControl){
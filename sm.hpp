@@ -1,6 +1,8 @@
 #ifndef SM_HPP_INCLUDED
 #define SM_HPP_INCLUDED
 
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -12,6 +14,7 @@ namespace sm{
 typedef unsigned char U8;
 typedef unsigned short U16;
 typedef unsigned U32;
+typedef unsigned long long U64;
 typedef std::vector<U8> Buffer;
 
 template<class T> class Array2D{
@@ -36,6 +39,9 @@ template<class T> class Array2D{
 			h=0;
 		}
 
+		bool operator==(const Array2D& other) const{ return w==other.w&&h==other.h&&data==other.data; }
+		bool operator!=(const Array2D& other) const{ return !(*this==other); }
+
 	private:
 		std::vector<T> data;
 		unsigned w, h;
@@ -54,6 +60,21 @@ struct Vertex{
 	unsigned tx, ty;//tile coordinates
 };
 
+//read-only window onto little endian data in a buffer
+class View{
+	public:
+		View(const Buffer& buffer, U32 offset): bytes(buffer.data()), offset(offset) {}
+		View(const U8* bytes, U32 offset): bytes(bytes), offset(offset) {}
+		U8 readU8(unsigned i) const{ return bytes[offset+i]; }
+		U16 readU16(unsigned i) const{ return readU8(i)|readU8(i+1)<<8; }
+		U32 readU24(unsigned i) const{ return readU16(i)|U32(readU8(i+2))<<16; }
+		U32 readU32(unsigned i) const{ return readU16(i)|U32(readU16(i+2))<<16; }
+		U32 readOffset() const{ return offset; }
+	protected:
+		const U8* bytes;
+		U32 offset;
+};
+
 template<class T> class SparseRangeArray{
 	public:
 		void set(unsigned start, unsigned size, T value){
@@ -92,16 +113,35 @@ template<class T> class SparseRangeArray{
 		std::vector<std::vector<T> > data;
 };
 
-template<class K, class V> void rekey(std::map<K, V>& map, const std::map<K, K>& keys){
-	std::vector<K> newKeys;
-	std::vector<V> values;
-	for(typename std::map<K, V>::iterator i=map.begin(); i!=map.end(); ++i){
-		newKeys.push_back(i->first);
-		values.push_back(i->second);
-	}
-	map.clear();
-	for(unsigned i=0; i<newKeys.size(); ++i) map[newKeys[i]]=values[i];
-}
+//records calls, time and bytes processed of the library's hot paths
+//only recorded when sm.cpp is built with SM_PROFILE defined, otherwise the macros below expand to nothing
+class Profile{
+	public:
+		class Scope{//times from construction to destruction
+			public:
+				Scope(const char* name, bool trace=true);//trace=false only adds to the totals, for very frequent calls
+				~Scope();
+				void addBytes(unsigned long long n){ bytes+=n; }
+			private:
+				const char* name;
+				bool trace;
+				unsigned long long bytes;
+				long long start;//in microseconds
+		};
+		static void clear();
+		static std::string json();//totals per name
+		static std::string chromeTrace();//each traced call, in Chrome's trace event format
+};
+
+#ifdef SM_PROFILE
+	#define SM_PROFILE_SCOPE(name) sm::Profile::Scope smProfileScope(name)
+	#define SM_PROFILE_TOTAL(name) sm::Profile::Scope smProfileScope(name, false)
+	#define SM_PROFILE_BYTES(n) smProfileScope.addBytes(n)
+#else
+	#define SM_PROFILE_SCOPE(name)
+	#define SM_PROFILE_TOTAL(name)
+	#define SM_PROFILE_BYTES(n)
+#endif
 
 //=====Super Metroid stuff=====//
 const unsigned TILE_SIZE=16;//tile size in pixels
@@ -109,6 +149,12 @@ const unsigned SCREEN_SIZE=16;//screen size in tiles
 const unsigned VANILLA_ROOMS=263;
 extern const U32 VANILLA_ROOM_OFFSETS[];
 
+class TransitionView;
+class SaveView;
+class EnemyView;
+class PlmView;
+struct Compressed;
+
 enum Region{
 	CRATERIA,
 	BRINSTAR,
@@ -121,28 +167,106 @@ enum Region{
 	REGIONS
 };
 
+//stable indices for rooms, with constant time lookup both ways
+class RoomRegistry{
+	public:
+		static const U16 NONE=0xFFFFu;//no room
+		static const U8 BANK=0x8Fu;//bank room headers are in
+		void clear();
+		U16 add(U32 offset);//returns index of room, registering it if it's new -- NONE if offset isn't in BANK
+		U16 find(U32 offset) const{//index of room at offset, NONE if there isn't one
+			U32 i=offset-BANK_START;
+			return i<indices.size()?indices[i]:NONE;
+		}
+		U32 readOffset(U16 room) const{ return offsets[room]; }
+		unsigned size() const{ return offsets.size(); }
+	private:
+		static const U32 BANK_START=(BANK&0x7Fu)<<15;
+		std::vector<U32> offsets;//room index to offset
+		std::vector<U16> indices;//offset from BANK_START to room index
+};
+
+//threads may share a const Rom, and a Room, Mode7, Transition or Save made from one, as long as nothing writes the Rom
+//writing -- takeSpace, freeSpace, saving, editing buffer or rooms -- needs the Rom to itself, see SharedRom
 class Rom{
 	public:
 		enum Usage{ UNKNOWN, HACKABLE, HACKED };
 		typedef SparseRangeArray<Usage> Index;
+		struct BankSpace{//usage of one bank's bytes
+			BankSpace(): bank(0), unknown(0), hackable(0), hacked(0), largestFree(0), freeRuns(0) {}
+			float readFragmentation() const{ return hackable?1.0f-1.0f*largestFree/hackable:0.0f; }//0 when free space is all in one run
+			U8 bank;
+			unsigned unknown, hackable, hacked;
+			unsigned largestFree;//longest run of hackable bytes, the biggest takeSpace that will succeed in this bank
+			unsigned freeRuns;//runs of hackable bytes
+		};
 		std::string open(std::string fileName);
 		bool indexVanilla();
 		bool takeSpace(U8 bank, U16 size, U32& offset);
 		bool takeSpace(U8 minBank, U8 maxBank, U16 size, U32& offset);
+		void freeSpace(U32 offset, U16 size);//give back space returned by takeSpace
+		void claimSpace(U32 offset, U16 size);//take particular space, for rewriting data where it already is
 		bool save(std::string fileName);
 		void dummify();//write dummy data over unused data
+		void findCompressed(std::vector<Compressed>& found) const;//compressed data the rooms in rooms use, each once
+		void measureSpace(std::vector<BankSpace>& banks) const;//one per bank of buffer
+		Usage readUsage(U32 offset) const{ return index[offset]; }
 		Buffer header, buffer;
+		RoomRegistry rooms;//vanilla rooms after open, building a DoorGraph adds the rooms reachable through doors
 	private:
 		Index index;
 };
 
+//a rom that many threads read while some write, copy on write style
+//readers take snapshots, which don't change and stay valid for as long as they're held
+//a writer edits its own copy of the current snapshot, which becomes the current snapshot on commit
+//writers take turns, so no writer's edits are lost
+class SharedRom{
+	public:
+		typedef std::shared_ptr<const Rom> Snapshot;
+		SharedRom(const Rom& rom): current(std::make_shared<const Rom>(rom)) {}
+		Snapshot snapshot() const;
+		class Writer{//holds up other writers while it exists, dropping its edits if destroyed without committing
+			public:
+				Writer(SharedRom& shared);
+				void commit();
+				Rom rom;
+			private:
+				SharedRom* shared;
+				std::lock_guard<std::mutex> turn;
+		};
+	private:
+		Snapshot current;
+		mutable std::mutex currentMutex;//guards current, only held to copy or replace it
+		std::mutex writerMutex;
+};
+
+//where compressed data is, and what it's for
+struct Compressed{
+	enum Kind{
+		LEVEL,//room tiles
+		MODE7,//tile sets 17 to 20 -- mode 7 tiles and graphics
+		GRAPHICS,
+		TILE_TABLE,
+		PALETTE,
+		COMMON_GRAPHICS,//common room elements
+		COMMON_TILE_TABLE
+	};
+	static std::string kindDescription(Kind kind);
+	Compressed(Kind kind, U32 offset): kind(kind), offset(offset) {}
+	Kind kind;
+	U32 offset;
+};
+
 class Transition{
 	public:
 		static const unsigned SIZE=12;
 		static const U8 BANK=0x83u;
-		Transition(Rom& rom): rom(&rom) {}
+		Transition(Rom& rom): rom(&rom), writable(&rom) {}
+		Transition(const Rom& rom): rom(&rom), writable(NULL) {}//can't save
 		void index(U32 offset, Rom::Index& index);
 		void open(U32 offset);
+		void open(const TransitionView& view);
 		bool save(U32& offset);
 		U32 room;//pointer to destination room
 		U8
@@ -168,7 +292,24 @@ class Transition{
 			distance,//distance Samus is placed on exit in pixels, 0x8000 means default
 			scroll;//pointer in bank 0x8F to code for updating scroll data
 	private:
-		Rom* rom;
+		const Rom* rom;
+		Rom* writable;//NULL if made from a const Rom
+};
+
+//Transition read in place
+class TransitionView: public View{
+	public:
+		TransitionView(const Buffer& buffer, U32 offset): View(buffer, offset) {}
+		TransitionView(const U8* bytes, U32 offset): View(bytes, offset) {}
+		U32 readRoom() const;
+		U8 readFlags() const{ return readU8(2); }
+		U8 readDirection() const{ return readU8(3); }
+		U8 readAnimationX() const{ return readU8(4); }
+		U8 readAnimationY() const{ return readU8(5); }
+		U8 readX() const{ return readU8(6); }
+		U8 readY() const{ return readU8(7); }
+		U16 readDistance() const{ return readU16(8); }
+		U16 readScroll() const{ return readU16(10); }
 };
 
 class Save{
@@ -179,10 +320,12 @@ class Save{
 		static const U16 START=0x44C5u;//offset of first save
 		static const U16 END=0x4D07u;//offset just past last save -- 0x4C19u would be a more conservative value, excluding (probably) debug region saves
 		static void index(Rom::Index& index);
-		Save(Rom& rom): rom(&rom) {}
+		Save(Rom& rom): rom(&rom), writable(&rom) {}
+		Save(const Rom& rom): rom(&rom), writable(NULL) {}//can't save or set region tables
 		U32 readRegionTable(Region region);
-		void setRegionTable(Region region, U32 offset);
+		bool setRegionTable(Region region, U32 offset);
 		void open(U32 offset);
+		void open(const SaveView& view);
 		bool save(U32& offset);
 		U32 room;//room that this save point is inside
 		U32 transition;//transition to room this save point is inside
@@ -192,7 +335,24 @@ class Save{
 		U16 samusY;//offset from top
 		U16 samusX;//offset from center
 	private:
-		Rom* rom;
+		const Rom* rom;
+		Rom* writable;//NULL if made from a const Rom
+};
+
+//Save read in place
+class SaveView: public View{
+	public:
+		SaveView(const Buffer& buffer, U32 offset): View(buffer, offset) {}
+		SaveView(const U8* bytes, U32 offset): View(bytes, offset) {}
+		bool atEnd() const{ return offset>=Save::END; }
+		SaveView next() const{ return SaveView(bytes, offset+Save::SIZE); }
+		U32 readRoom() const;
+		U32 readTransition() const;
+		U16 readUnknown() const{ return readU16(4); }
+		U16 readScrollX() const{ return readU16(6); }
+		U16 readScrollY() const{ return readU16(8); }
+		U16 readSamusY() const{ return readU16(10); }
+		U16 readSamusX() const{ return readU16(12); }
 };
 
 class Mode7{
@@ -201,16 +361,41 @@ class Mode7{
 		static const U8 LAST_BANK=0xCEu;
 		static const U8 FIRST_TILE_SET=17;
 		static const U8 LAST_TILE_SET=20;
-		Mode7(Rom& rom): rom(&rom) {}
+		static const unsigned SIZE=128;//in tiles, each way
+		static const unsigned BITMAP_SIZE=SIZE*TILE_SIZE/2;//in pixels, each way
+		struct Affine{//the SNES registers that place mode 7 on screen, as written to them
+			Affine(): a(0x100u), b(0), c(0), d(0x100u), h(0), v(0), x(0), y(0), settings(0) {}
+			U16 a, b, c, d;//M7A to M7D, signed 8.8 fixed point matrix
+			U16 h, v;//M7HOFS and M7VOFS, scroll
+			U16 x, y;//M7X and M7Y, center of rotation and scaling
+			U8 settings;//M7SEL -- 0x01 flips horizontally, 0x02 vertically, 0x80 shows transparency outside the map, 0xC0 shows tile 0
+		};
+		Mode7(Rom& rom): rom(&rom), writable(&rom), tileSet(0), compressedOffset(0) {}
+		Mode7(const Rom& rom): rom(&rom), writable(NULL), tileSet(0), compressedOffset(0) {}//can't save
 		void index(U8 tileSet, Rom::Index& index);
 		void open(U8 tileSet);
+		//compresses again only from the first changed tile on, rewriting in place if it still fits, else moving and freeing what it took before
 		bool save(U8 tileSet);
 		void clear();
-		Array2D<U8> tiles;
+		const Array2D<U8>& readTiles() const{ return tiles; }
+		void setTile(unsigned i, unsigned j, U8 tile);
+		//palette indices of the whole map, 0 is transparent -- kept up to date by open and setTile, so readers sharing a const Mode7 only read it
+		const Array2D<U8>& readBitmap() const{ return bitmap; }
+		//palette indices of what the SNES shows, as w by h pixels from the top left of the screen
+		void drawAffine(Array2D<U8>& destination, const Affine& affine, unsigned w=256, unsigned h=224) const;
 	private:
 		U32 dataOffset(U8 tileSet);
-		Rom* rom;
-		Buffer data;
+		void drawTile(unsigned i, unsigned j);//into bitmap
+		U8 readPixel(U8 tile, unsigned x, unsigned y) const{ return data[2*(TILE_SIZE/2*TILE_SIZE/2*tile+TILE_SIZE/2*y+x)+1]; }
+		const Rom* rom;
+		Rom* writable;//NULL if made from a const Rom
+		Buffer data;//tiles and graphics interleaved, as on rom
+		U8 tileSet;//opened or last saved to
+		Buffer compressed;//data as on rom
+		U32 compressedOffset;
+		Array2D<U8> tiles;
+		Array2D<U8> savedTiles;//tiles as on rom, tiles that differ are changed
+		Array2D<U8> bitmap;
 };
 
 class Header{
@@ -231,6 +416,7 @@ class Header{
 		static std::string codeDescription(Code code);
 		Header(){}
 		Header(const Buffer& buffer, U32 offset);
+		void read(const Buffer& buffer, U32 offset);//same as constructing, but reuses stateInfo's memory
 		unsigned size();//size in bytes on rom
 		void write(Buffer& buffer, U32 offset) const;
 		U8
@@ -249,13 +435,13 @@ class Header{
 		U32 doors;
 		struct StateInfo{
 			Code code;
-			Buffer fields;
+			U8 fields[2];//only the first fieldSize(code) are used
 			U32 state;
 		};
 		std::vector<StateInfo> stateInfo;
+		static unsigned fieldSize(Code code);//size in bytes on rom
 	private:
 		static const unsigned MAIN_SIZE=11;
-		static unsigned fieldSize(Code code);//size in bytes on rom
 		static unsigned stateInfoSize(Code code);//size in bytes on rom
 };
 
@@ -285,6 +471,44 @@ struct State{
 	U16 layerHandling;//pointer in bank 0x8F
 };
 
+//a state's scroll data, 2 bits a screen packed row by row, with a bitmask of the screens that aren't hidden
+//screens are indexed x+y*screensWide, as on rom
+class ScrollMap{
+	public:
+		enum Value{
+			HIDDEN=0,
+			CROPPED=1,//shown except for the top and bottom 2 tile rows
+			SHOWN=2
+		};
+		static const unsigned CROP=2*TILE_SIZE;//pixels of a CROPPED screen the camera doesn't show, at top and bottom
+		ScrollMap(): w(0), h(0) {}
+		void resize(unsigned screensWide, unsigned screensHigh, U8 value=HIDDEN);//every screen set to value
+		void read(const Buffer& buffer, U32 offset, unsigned screensWide, unsigned screensHigh);//a byte a screen, only the low 2 bits are kept
+		void write(Buffer& buffer, U32 offset) const;
+		unsigned readScreensWide() const{ return w; }
+		unsigned readScreensHigh() const{ return h; }
+		unsigned size() const{ return w*h; }
+		U8 readScreen(unsigned x, unsigned y) const{
+			unsigned k=x+y*w;
+			return screens[k/32]>>2*(k%32)&3;
+		}
+		void setScreen(unsigned x, unsigned y, U8 value);
+		bool readVisible(unsigned x, unsigned y) const{
+			unsigned k=x+y*w;
+			return visible[k/64]>>k%64&1;
+		}
+		const std::vector<U64>& readVisibleMask() const{ return visible; }//bit k%64 of word k/64 is set if screen k isn't hidden
+		//keeps a camera of viewW by viewH pixels with its top left at x, y in the screens the camera can reach from screen screenX, screenY
+		//(usually Samus'), as the game does -- horizontally along visible screens in the same row, vertically in the same column
+		void clampCamera(unsigned screenX, unsigned screenY, int& x, int& y, unsigned viewW=256, unsigned viewH=224) const;
+		bool operator==(const ScrollMap& other) const{ return w==other.w&&h==other.h&&screens==other.screens; }
+		bool operator!=(const ScrollMap& other) const{ return !(*this==other); }
+	private:
+		unsigned w, h;//in screens
+		std::vector<U64> screens;//32 screens a word, unused bits are 0
+		std::vector<U64> visible;//64 screens a word, unused bits are 0
+};
+
 struct TileAssembler{
 	TileAssembler(U16 ul, U16 ur, U16 dl, U16 dr): ul(ul), ur(ur), dl(dl), dr(dr) {}
 	U16 ul, ur, dl, dr;
@@ -313,6 +537,7 @@ struct Enemy{
 	static const U16 SENTINEL=0xFFFFu;
 	Enemy(): species(0), x(0), y(0), field1(0), field2(0), field3(0), field4(0), field5(0) {}
 	Enemy(const Buffer& buffer, U32 offset);
+	Enemy(const EnemyView& view);
 	void write(Buffer& buffer, U32 offset) const;
 	U16
 		species,//pointer to enemy data in bank 0xA0
@@ -325,12 +550,26 @@ struct Enemy{
 		field5;
 };
 
+//Enemy read in place, lists end with the sentinel
+class EnemyView: public View{
+	public:
+		EnemyView(const Buffer& buffer, U32 offset): View(buffer, offset) {}
+		EnemyView(const U8* bytes, U32 offset): View(bytes, offset) {}
+		bool atEnd() const{ return readU16(0)==Enemy::SENTINEL; }
+		EnemyView next() const{ return EnemyView(bytes, offset+Enemy::SIZE); }
+		U16 readSpecies() const{ return readU16(0); }
+		U16 readX() const{ return readU16(2); }
+		U16 readY() const{ return readU16(4); }
+		U16 readField(unsigned i) const{ return readU16(4+2*i); }//i from 1 to 5
+};
+
 struct Plm{//post load modification
 	static const unsigned SIZE=6;//size in bytes on rom
 	static const U8 BANK=0x8Fu;
 	static const U16 SENTINEL=0;
 	Plm(): x(0), y(0), field1(0), field2(0) {}
 	Plm(const Buffer& buffer, U32 offset);
+	Plm(const PlmView& view);
 	void write(Buffer& buffer, U32 offset) const;
 	U16 type;//pointer in bank 0x84
 	U8
@@ -340,49 +579,342 @@ struct Plm{//post load modification
 		field2;
 };
 
+//Plm read in place, lists end with the sentinel
+class PlmView: public View{
+	public:
+		PlmView(const Buffer& buffer, U32 offset): View(buffer, offset) {}
+		PlmView(const U8* bytes, U32 offset): View(bytes, offset) {}
+		bool atEnd() const{ return readU16(0)==Plm::SENTINEL; }
+		PlmView next() const{ return PlmView(bytes, offset+Plm::SIZE); }
+		U16 readType() const{ return readU16(0); }
+		U8 readX() const{ return readU8(2); }
+		U8 readY() const{ return readU8(3); }
+		U8 readField(unsigned i) const{ return readU8(3+i); }//i from 1 to 2
+};
+
 class Room{
 	public:
 		static const U8 BANK=0x8Fu;
-		Room(Rom& rom): rom(&rom), mode7(rom) {}
+		typedef std::map<U8, unsigned> BankUsage;//map from bank to bytes
+		Room(Rom& rom): rom(&rom), writable(&rom), headerOffset(0), mode7(rom) {}
+		Room(const Rom& rom): rom(&rom), writable(NULL), headerOffset(0), mode7(rom) {}//can't save or measure saves
 		bool index(U32 offset, Rom::Index& index);
 		bool open(U32 offset);
+		//all or nothing -- on failure, the rom and room are left as they were
+		//the header is rewritten where it was opened from, so doors and saves leading to the room still do, and offset is set to it
+		//the rest of the data moves -- space an earlier save since open took is freed, what open found is left as it may be shared
 		bool save(U32& offset);
+		bool measureSave(BankUsage& usage);//dry run of save, reports bytes that would be taken in each bank
 		void setState(unsigned i){ stateIndex=i; }
 		void loadGraphics();
 		void drawTileSet(Array2D<Color>&, unsigned tilesWide) const;
+		//palette swaps without reloading graphics -- drawTileSet's layout as indices into readPalette, 0 is transparent
+		void drawIndexedTileSet(Array2D<U8>&, unsigned tilesWide) const;
+		const std::vector<Color>& readPalette() const{ return palette; }
+		void setPalette(const std::vector<Color>& p){ palette=p; }//used by later draws, reset by loadGraphics
 		void getQuadsVertexArray(
 			std::vector<Vertex>&, unsigned tilesWide,//tilesWide should be same as used in drawTileSet
 			bool showLayer1=true, bool showLayer2=true, bool showMode7=true
 		) const;
 		bool readDoor(unsigned x, unsigned y, Transition& transition);
+		const std::vector<U32>& readDoors() const{ return doors; }//offsets of transitions, indexed by door tile bts
 		unsigned readW() const{ return header.width *SCREEN_SIZE*TILE_SIZE; }
 		unsigned readH() const{ return header.height*SCREEN_SIZE*TILE_SIZE; }
 		unsigned readStates() const{ return states.size(); }
 		Header::Code readStateCode(unsigned i) const;
+		const ScrollMap& readScroll() const;//current state's, states with one scroll value for the whole room get a map filled with it
+		std::string compare(const Room& other) const;//empty if the rooms' doors and every state's scroll, tiles, enemies and post load modifications match, else the first difference
+		struct Differences{//counts of what doesn't match another room, summed over states -- elements only one room has count as different
+			Differences(): header(false), states(0), tiles(0), bts(0), enemies(0), plm(0), doors(0), scroll(0) {}
+			bool header;//map location, size, scrolling or graphics flags
+			unsigned
+				states,//states only one room has, or whose condition or settings (tile set, music, fx and so on) differ
+				tiles, bts, enemies, plm,
+				doors,//doors only one room has, transitions themselves aren't compared
+				scroll;//screens
+			bool readSame() const{ return !header&&!states&&!tiles&&!bts&&!enemies&&!plm&&!doors&&!scroll; }
+		};
+		Differences countDifferences(const Room& other) const;//states are compared by index
+		void writeBundle(Buffer& bundle) const;//appends this room's record and sections, see Bundle
+		//editing -- edits are to the current state's data, which other states may share
+		//setters return false if i is out of range, setting one past the end of a list appends
+		const Tile& readTile(unsigned i, unsigned j) const{ return readStateTiles().at(i, j); }
+		bool setTile(unsigned i, unsigned j, const Tile& tile);
+		const std::vector<Enemy>& readEnemies() const;
+		bool setEnemy(unsigned i, const Enemy& enemy);
+		const std::vector<Plm>& readPlm() const;
+		bool setPlm(unsigned i, const Plm& p);
+		bool setDoor(unsigned i, U32 transition);//i is the bts of the door tiles
+		unsigned prepareSave();//compresses level data ahead of save, which can then be done on another thread -- returns compressed size
+		//mode 7 as one bitmap, instead of getQuadsVertexArray's quad per tile -- needs loadGraphics
+		//without affine, the whole map, else what the SNES would show -- index 0 is transparent either way
+		const Mode7& readMode7() const{ return mode7; }
+		void drawMode7(Array2D<Color>& destination, const Mode7::Affine* affine=NULL) const;
 	private:
+		struct Block{
+			U32 offset;
+			Buffer data;//what will be written at offset
+			bool taken;//space was taken for it, so release gives it back
+		};
+		struct SavePlan{
+			std::vector<Block> blocks;//space taken so far
+			Header header;
+			std::vector<State> states;
+			U32 offset;//where header goes
+			//map handle to written location
+			std::vector<U32> scrollHacks, tileHacks, enemyHacks, plmHacks;
+		};
+		struct Span{
+			U32 offset;
+			unsigned size;
+		};
+		struct Handles{//indices into the data that can be shared between states
+			static const unsigned NONE=~0u;
+			Handles(): scroll(NONE), tiles(NONE), enemies(NONE), plm(NONE) {}
+			unsigned scroll, tiles, enemies, plm;
+		};
+		bool planSave(SavePlan& plan);
+		Buffer* reserve(SavePlan& plan, U8 minBank, U8 maxBank, unsigned size, U32& offset);
+		void release(const SavePlan& plan);
+		unsigned sharedHandle(unsigned s, U32 State::* pointer, unsigned Handles::* handle) const;
 		bool convertScreenToTile(unsigned& x, unsigned& y) const;
-		const Array2D<Tile>& readStateTiles() const{ return tiles.find(states[stateIndex].tiles)->second; }
-		Rom* rom;
+		void compressTiles(unsigned handle, Buffer& compressed) const;
+		const Array2D<Tile>& readStateTiles() const{ return tiles[handles[stateIndex].tiles]; }
+		const Rom* rom;
+		Rom* writable;//NULL if made from a const Rom
 		//per room
+		U32 headerOffset;//where header was opened from or last saved to
 		Header header;
 		std::vector<U32> doors;
+		std::vector<Span> taken;//rom space this room's saves took since it was opened, freed once a later save moves off it
 		//per state
 		std::vector<State> states;
-		//shareable between states
-		std::map<U32, Array2D<U8> > scroll;//map from identifier to scroll data
-		std::map<U32, Array2D<Tile> > tiles;//map from identifier to tiles
-		std::map<U32, std::vector<Enemy> > enemies;//map from identifier to enemies
-		std::map<U32, std::vector<Plm> > plm;//map from identifier to plm
+		std::vector<Handles> handles;
+		//shareable between states, indexed by handle -- elements no handle refers to are kept for reuse by open
+		std::vector<ScrollMap> scroll;
+		ScrollMap constantScroll[3];//filled with each scroll value, for states without scroll data
+		std::vector<Array2D<Tile> > tiles;
+		std::vector<std::vector<Enemy> > enemies;
+		std::vector<std::vector<Plm> > plm;
+		std::vector<Buffer> compressedTiles;//by tiles handle, empty until prepareSave and after edits
 		//for interacting with a state
 		unsigned stateIndex;
 		Mode7 mode7;
-		std::vector<Array2D<Color> > tileSet;
-		std::vector<Array2D<Color> > mode7TileSet;
+		std::vector<Color> palette;
+		std::vector<Array2D<U8> > tileSet;//palette indices
+		std::vector<Array2D<U8> > mode7TileSet;
+		Buffer scratch;//kept between opens to reuse its memory
+};
+
+//edits to many rooms, applied so each room is opened, compressed and saved once
+class RoomEdits{
+	public:
+		struct Edit{
+			enum Kind{ TILE, ENEMY, PLM, DOOR };
+			Kind kind;
+			U32 room;
+			unsigned state, i, j;
+			Tile tile;
+			Enemy enemy;
+			Plm plm;
+			U32 transition;
+		};
+		RoomEdits(Rom& rom): rom(&rom) {}
+		//room is the offset of the room's header, edits are applied in the order they're added -- see Room's setters
+		void setTile(U32 room, unsigned state, unsigned i, unsigned j, const Tile& tile);
+		void setEnemy(U32 room, unsigned state, unsigned i, const Enemy& enemy);
+		void setPlm(U32 room, unsigned state, unsigned i, const Plm& p);
+		void setDoor(U32 room, unsigned i, U32 transition);
+		unsigned size() const{ return edits.size(); }
+		void clear(){ edits.clear(); }
+		//opens, edits and compresses rooms across threads, then saves them largest first so big level data gets first pick of space
+		//rooms that fail to open, edit or save are left as they were and added to failed
+		//0 threads means one per hardware thread
+		bool apply(std::vector<U32>* failed=NULL, unsigned threads=0);
+	private:
+		Edit& add(Edit::Kind kind, U32 room, unsigned state, unsigned i);
+		Rom* rom;
+		std::vector<Edit> edits;
+};
+
+//every room of a rom decoded into one versioned binary, for tools that can't decompress or parse rom data
+//numbers are little endian, offsets are from the start of the bundle and sections are 4 byte aligned, so it can be read memory mapped
+//	bundle: "SMRB", U32 version, U32 rooms, then a U32 offset of each room's record by room index -- any room is found without reading the others
+//	room, ROOM_SIZE bytes: U32 header offset on rom, U8 index, region, x, y, width, height, upScroll, downScroll, graphicsFlags, 3 padding,
+//		U32 states, U32 offset of states, U32 doors, U32 offset of doors (U32 transition offsets on rom, by door bts)
+//	state, STATE_SIZE bytes: U16 code, U8 fields[2], U32 state offset on rom, U8 tileSet, musicTrack, musicControl, hasLayer2,
+//		U16 fx1, enemySet, layer2, unknown, fx2, background, layerHandling, 2 padding,
+//		U32 tiles wide, tiles high, offset of layer 1, offset of layer 2 (0 without), offset of bts, offset of scroll,
+//		U32 enemies, offset of enemies, U32 plm, offset of plm
+//	layers are U16 tile layers packed as in level data and bts are U8s, both row by row, scroll is a U8 per screen row by row
+//	enemies and plm are as on rom, each list followed by its sentinel -- states that share data share its section
+class Bundle{
+	public:
+		static const U32 VERSION=1;
+		static const unsigned HEADER_SIZE=12;
+		static const unsigned ROOM_SIZE=32;
+		static const unsigned STATE_SIZE=68;
+		static bool write(const Rom& rom, Buffer& bundle);//every room in rom.rooms -- false if one doesn't open
+};
+
+//bundle state read in place
+class BundleStateView: public View{
+	public:
+		BundleStateView(const Buffer& buffer, U32 offset): View(buffer, offset) {}
+		BundleStateView(const U8* bytes, U32 offset): View(bytes, offset) {}
+		Header::Code readCode() const{ return Header::Code(readU16(0)); }
+		U8 readField(unsigned i) const{ return readU8(2+i); }//i from 0 to 1
+		U32 readStateOffset() const{ return readU32(4); }
+		U8 readTileSet() const{ return readU8(8); }
+		U8 readMusicTrack() const{ return readU8(9); }
+		U8 readMusicControl() const{ return readU8(10); }
+		bool readHasLayer2() const{ return readU8(11); }
+		U16 readFx1() const{ return readU16(12); }
+		U16 readEnemySet() const{ return readU16(14); }
+		U16 readLayer2() const{ return readU16(16); }
+		U16 readUnknown() const{ return readU16(18); }
+		U16 readFx2() const{ return readU16(20); }
+		U16 readBackground() const{ return readU16(22); }
+		U16 readLayerHandling() const{ return readU16(24); }
+		unsigned readTilesWide() const{ return readU32(28); }
+		unsigned readTilesHigh() const{ return readU32(32); }
+		Tile readTile(unsigned i, unsigned j) const;
+		U8 readScroll(unsigned screenX, unsigned screenY) const{ return bytes[readU32(48)+screenX+screenY*readTilesWide()/SCREEN_SIZE]; }
+		unsigned readEnemies() const{ return readU32(52); }
+		EnemyView readFirstEnemy() const{ return EnemyView(bytes, readU32(56)); }
+		unsigned readPlms() const{ return readU32(60); }
+		PlmView readFirstPlm() const{ return PlmView(bytes, readU32(64)); }
 };
 
+//bundle room read in place
+class BundleRoomView: public View{
+	public:
+		BundleRoomView(const Buffer& buffer, U32 offset): View(buffer, offset) {}
+		BundleRoomView(const U8* bytes, U32 offset): View(bytes, offset) {}
+		U32 readHeaderOffset() const{ return readU32(0); }
+		U8 readIndex() const{ return readU8(4); }
+		Region readRegion() const{ return Region(readU8(5)); }
+		U8 readX() const{ return readU8(6); }
+		U8 readY() const{ return readU8(7); }
+		U8 readWidth() const{ return readU8(8); }
+		U8 readHeight() const{ return readU8(9); }
+		U8 readUpScroll() const{ return readU8(10); }
+		U8 readDownScroll() const{ return readU8(11); }
+		U8 readGraphicsFlags() const{ return readU8(12); }
+		unsigned readStates() const{ return readU32(16); }
+		BundleStateView readState(unsigned i) const{ return BundleStateView(bytes, readU32(20)+i*Bundle::STATE_SIZE); }
+		unsigned readDoors() const{ return readU32(24); }
+		U32 readDoor(unsigned i) const{ return View(bytes, readU32(28)).readU32(4*i); }//transition offset on rom
+};
+
+//bundle read in place -- check it before reading anything else
+class BundleView: public View{
+	public:
+		BundleView(const Buffer& buffer): View(buffer, 0), size(buffer.size()) {}
+		BundleView(const U8* bytes, U32 size): View(bytes, 0), size(size) {}//memory mapped, say
+		bool check() const;//false if the bytes aren't a bundle of this version or anything in them points past their end
+		U32 readVersion() const{ return readU32(4); }
+		unsigned readRooms() const{ return readU32(8); }
+		BundleRoomView readRoom(unsigned i) const{ return BundleRoomView(bytes, readU32(Bundle::HEADER_SIZE+4*i)); }
+	private:
+		U32 size;
+};
+
+//rooms and the transitions between them, stored compressed sparse row style
+class DoorGraph{
+	public:
+		struct Edge{
+			U32 transition;//offset of transition
+			U16 room;//index of destination room, RoomRegistry::NONE if none
+			U8 direction, flags;//see Transition
+			bool readElevator() const{ return flags&0x80u; }
+			bool readSwitchRegion() const{ return flags&0x40u; }
+		};
+		//reads every room in rom.rooms, registering rooms that doors lead to, 0 threads means one per hardware thread
+		//rooms are indexed as in rom.rooms
+		bool build(Rom& rom, unsigned threads=0);
+		unsigned readRooms() const{ return first.size()-1; }
+		unsigned readDoors(U16 room) const{ return first[room+1]-first[room]; }
+		const Edge& readDoor(U16 room, unsigned door) const{ return edges[first[room]+door]; }
+		unsigned readEdges() const{ return edges.size(); }
+		unsigned readEdgeIndex(U16 room, unsigned door) const{ return first[room]+door; }//index among all edges
+		const Edge& readEdge(unsigned i) const{ return edges[i]; }
+	private:
+		std::vector<unsigned> first;//index of each room's first edge, then the number of edges
+		std::vector<Edge> edges;
+};
+
+//reachability through doors of a DoorGraph with some doors rewired, without touching the rom
+class DoorValidator{
+	public:
+		struct Rewire{
+			U16 room;//room the door is in
+			unsigned door;//index in room's doors
+			U16 destination;//room the door leads to instead
+		};
+		typedef std::vector<Rewire> Seed;
+		DoorValidator(const DoorGraph& graph);
+		unsigned search(const Seed& seed, U16 start);//returns number of rooms reachable from start
+		bool readReached(U16 room) const{ return reached[room]; }//as of last search
+		bool connects(const Seed& seed, U16 from, U16 to);
+		//results[i] is whether every room in required is reachable from start with seeds[i], seeds are spread across threads
+		static void validate(
+			const DoorGraph& graph, const std::vector<Seed>& seeds, U16 start, const std::vector<U16>& required,
+			std::vector<char>& results, unsigned threads=0//0 threads means one per hardware thread
+		);
+	private:
+		void apply(const Seed& seed);
+		const DoorGraph* graph;
+		std::vector<U16> destinations;//destination of each edge with the current seed applied
+		std::vector<unsigned> rewired;//edges the current seed changed
+		std::vector<char> reached;
+		std::vector<U16> queue;
+};
+
+//rooms of two roms compared by structure, which still lines up after a hack moves data around
+class RomDiff{
+	public:
+		struct Pair{
+			Pair(): a(RoomRegistry::NONE), b(RoomRegistry::NONE), byDoors(false), bytesSame(false) {}
+			U16 a, b;//index of the room in each rom's rooms, RoomRegistry::NONE if only the other rom has it
+			bool byDoors;//paired by position in the door graphs rather than by header offset
+			bool bytesSame;//all the rooms' data matched byte for byte, so they weren't decoded
+			Room::Differences differences;//doors also counts transitions that differ, destinations being compared through the pairing
+			bool readSame() const{ return a!=RoomRegistry::NONE&&b!=RoomRegistry::NONE&&differences.readSame(); }
+		};
+		//builds both roms' door graphs, registering rooms doors lead to, then pairs rooms at the same header offset
+		//rooms left over are paired when the same door of paired rooms leads to them
+		//pairs are compared spread across threads, 0 threads means one per hardware thread -- false if a door graph can't be built
+		bool build(Rom& a, Rom& b, unsigned threads=0);
+		const std::vector<Pair>& readPairs() const{ return pairs; }//in order of a's rooms, then rooms only b has
+		const DoorGraph& readGraphA() const{ return graphs[0]; }
+		const DoorGraph& readGraphB() const{ return graphs[1]; }
+	private:
+		DoorGraph graphs[2];
+		std::vector<U16> partners[2];//room in the other rom each rom's rooms are paired with
+		std::vector<Pair> pairs;
+};
+
+//SNES format 5 compression
+unsigned decompress(const Buffer& source, U32 offset, Buffer* destination=NULL);//returns size of compressed data
+void compress(const Buffer& source, Buffer& destination);
+//same as compress, when compressed decompresses to source up to changed -- only what's from changed on is compressed again
+void recompress(const Buffer& source, const Buffer& compressed, unsigned changed, Buffer& destination);
+
+//SNES graphics
+void decodeSubtiles(const Buffer& graphics, Buffer& subtiles);//4bpp planar 8x8 subtiles to a palette index (0-15) per byte, 64 per subtile as 8 columns of 8 like Array2D
+//16x16 tiles of palette indices, 0 for transparent, subtiles past the end are left transparent
+//generic draws every pixel through the flip masks instead of the specialized kernels, to check and time them against
+void assembleTiles(const Buffer& subtiles, const std::vector<TileAssembler>& assemblers, std::vector<Array2D<U8> >& tiles, bool generic=false);
+
 std::string musicControlDescription(U8 musicControl);
 std::string musicTrackDescription(U8 musicTrack);
 
+//room elements compared the way Room::compare and countDifferences do
+bool same(const Tile& a, const Tile& b);
+bool same(const Enemy& a, const Enemy& b);
+bool same(const Plm& a, const Plm& b);
+
 };//namespace sm
 
 #endif
@@ -0,0 +1,76 @@
+#include "sm.hpp"
+
+#include "SFML/Graphics.hpp"//SFML 2.0 RC
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+using namespace sm;
+
+const unsigned BYTES_PER_PIXEL=128;//each bank is a row of 0x8000/BYTES_PER_PIXEL pixels
+const unsigned ROW_HEIGHT=4;
+
+//red for hacked, green for hackable, grey for unknown, mixed by how many bytes of each the pixel covers
+void drawHeatMap(const Rom& rom, sf::Image& image){
+	unsigned banks=rom.buffer.size()/0x8000u;
+	image.create(0x8000u/BYTES_PER_PIXEL, banks*ROW_HEIGHT, sf::Color::Black);
+	for(unsigned b=0; b<banks; ++b)
+		for(unsigned x=0; x<0x8000u/BYTES_PER_PIXEL; ++x){
+			unsigned counts[3]={0, 0, 0};
+			U32 start=b<<15|x*BYTES_PER_PIXEL;
+			for(U32 i=start; i<start+BYTES_PER_PIXEL; ++i) ++counts[rom.readUsage(i)];
+			sf::Color color(
+				(0x60u*counts[Rom::UNKNOWN]+0xFFu*counts[Rom::HACKED])/BYTES_PER_PIXEL,
+				(0x60u*counts[Rom::UNKNOWN]+0xFFu*counts[Rom::HACKABLE])/BYTES_PER_PIXEL,
+				(0x60u*counts[Rom::UNKNOWN])/BYTES_PER_PIXEL
+			);
+			for(unsigned y=0; y<ROW_HEIGHT; ++y) image.setPixel(x, b*ROW_HEIGHT+y, color);
+		}
+}
+
+//usage: space rom [heat map png]
+//indexes the vanilla data of rom and reports how each bank's bytes are used
+int main(int argc, char** argv){
+	if(argc<2){
+		std::cout<<"usage: space rom [heat map png]\n";
+		return -1;
+	}
+	Rom rom;
+	std::string error=rom.open(argv[1]);
+	if(error!=""){
+		std::cout<<argv[1]<<": "<<error<<"\n";
+		return -1;
+	}
+	if(!rom.indexVanilla()){
+		std::cout<<"couldn't index vanilla rom\n";
+		return -1;
+	}
+	std::vector<Rom::BankSpace> banks;
+	rom.measureSpace(banks);
+	Rom::BankSpace total;
+	std::printf("%4s %8s %8s %8s %12s %9s %13s\n", "bank", "unknown", "hackable", "hacked", "largest free", "free runs", "fragmentation");
+	for(unsigned i=0; i<banks.size(); ++i){
+		const Rom::BankSpace& b=banks[i];
+		total.unknown+=b.unknown;
+		total.hackable+=b.hackable;
+		total.hacked+=b.hacked;
+		total.largestFree=std::max(total.largestFree, b.largestFree);
+		total.freeRuns+=b.freeRuns;
+		if(b.unknown==0x8000u) continue;//nothing known about bank
+		std::printf(
+			"  %02X %8u %8u %8u %12u %9u %13.3f\n",
+			b.bank, b.unknown, b.hackable, b.hacked, b.largestFree, b.freeRuns, b.readFragmentation()
+		);
+	}
+	std::printf("%4s %8u %8u %8u %12u %9u\n", "all", total.unknown, total.hackable, total.hacked, total.largestFree, total.freeRuns);
+	if(argc>2){
+		sf::Image image;
+		drawHeatMap(rom, image);
+		if(!image.saveToFile(argv[2])){
+			std::cout<<"couldn't save "<<argv[2]<<"\n";
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -2,10 +2,15 @@
 
 #include "SFML/Graphics.hpp"//SFML 2.0 RC
 
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
 #include <cmath>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <utility>
 
 using namespace sm;
 
@@ -13,6 +18,14 @@ const float MAX_ZOOM=8.0f;
 const float MIN_ZOOM=0.5f;
 const float ZOOM_SPEED=1.5f;
 const unsigned TILES_WIDE=32;
+//looks up the colors of an index texture, made by toIndexImage, in a palette texture, made by toPaletteImage
+const char* PALETTE_SHADER=
+	"uniform sampler2D indices;\n"
+	"uniform sampler2D palette;\n"
+	"void main(){\n"
+	"	float index=texture2D(indices, gl_TexCoord[0].xy).r;\n"
+	"	gl_FragColor=gl_Color*texture2D(palette, vec2((index*255.0+0.5)/256.0, 0.5));\n"
+	"}\n";
 
 template <class T> std::string toString(T t){
 	std::stringstream ss;
@@ -20,9 +33,10 @@ template <class T> std::string toString(T t){
 	return ss.str();
 }
 
-void updateTiles(sm::Room& room, sf::VertexArray& level, bool layer1, bool layer2, bool mode7){
+//mode 7 is drawn separately, see setupMode7
+void updateTiles(sm::Room& room, sf::VertexArray& level, bool layer1, bool layer2){
 	std::vector<Vertex> vertices;
-	room.getQuadsVertexArray(vertices, TILES_WIDE, layer1, layer2, mode7);
+	room.getQuadsVertexArray(vertices, TILES_WIDE, layer1, layer2, false);
 	level.clear();
 	level.setPrimitiveType(sf::Quads);
 	for(unsigned i=0; i<vertices.size(); ++i)
@@ -52,26 +66,189 @@ void drawTexture(const sf::Texture& texture, sf::VertexArray& vertices){
 	));
 }
 
-void setupRoom(sm::Room& room, U16 index, int& state, sf::Texture& tilesTexture, sf::VertexArray& level, float& x, float& y, bool layer1, bool layer2, bool mode7, bool standardState){
-	room.open(sm::VANILLA_ROOM_OFFSETS[index]);
-	if(standardState) state=room.readStates()-1;
-	room.setState(state);
-	room.loadGraphics();
-	Array2D<Color> tilesBuffer;
-	room.drawTileSet(tilesBuffer, TILES_WIDE);
-	sf::Image tilesImage;
-	tilesImage.create(tilesBuffer.readISize(), tilesBuffer.readJSize());
-	for(unsigned i=0; i<tilesImage.getSize().x; ++i)
-		for(unsigned j=0; j<tilesImage.getSize().y; ++j){
-			Color c=tilesBuffer.at(i, j);
-			tilesImage.setPixel(i, j, sf::Color(c.r*255, c.g*255, c.b*255, c.a*255));
+void toImage(const Array2D<Color>& buffer, sf::Image& image){
+	image.create(buffer.readISize(), buffer.readJSize());
+	for(unsigned i=0; i<image.getSize().x; ++i)
+		for(unsigned j=0; j<image.getSize().y; ++j){
+			Color c=buffer.at(i, j);
+			image.setPixel(i, j, sf::Color(c.r*255, c.g*255, c.b*255, c.a*255));
 		}
-	tilesTexture.loadFromImage(tilesImage);
-	updateTiles(room, level, layer1, layer2, mode7);
+}
+
+//palette indices in the red channel
+void toIndexImage(const Array2D<U8>& buffer, sf::Image& image){
+	image.create(buffer.readISize(), buffer.readJSize());
+	for(unsigned i=0; i<image.getSize().x; ++i)
+		for(unsigned j=0; j<image.getSize().y; ++j)
+			image.setPixel(i, j, sf::Color(buffer.at(i, j), 0, 0, 255));
+}
+
+//256 by 1, index 0 is transparent
+void toPaletteImage(const std::vector<Color>& palette, sf::Image& image){
+	image.create(256, 1, sf::Color(0, 0, 0, 0));
+	for(unsigned i=1; i<256&&i<palette.size(); ++i){
+		Color c=palette[i];
+		image.setPixel(i, 0, sf::Color(c.r*255, c.g*255, c.b*255, c.a*255));
+	}
+}
+
+//how long each stage of loading the last room took, in seconds
+struct LoadTimes{
+	LoadTimes(): open(0.0f), graphics(0.0f), atlas(0.0f), geometry(0.0f) {}
+	float open, graphics, atlas, geometry;
+};
+
+//a loaded room with everything the ui thread needs to show it, short of uploading the images
+struct LoadedRoom{
+	LoadedRoom(const sm::Rom& rom): room(rom), index(0), state(0), opened(false), layer1(true), layer2(true), level(sf::Quads) {}
+	sm::Room room;
+	U16 index;
+	int state;
+	bool opened;//if not, nothing past index was loaded
+	bool layer1, layer2;//what level was built with
+	sf::Image tiles, mode7;//mode7 is empty if the room has no mode 7
+	sf::Image palette;//if indexed, tiles are indices into palette instead of colors
+	sf::VertexArray level;
+	LoadTimes times;
+};
+
+//opens rooms and builds their atlases and geometry on a worker thread so the window stays responsive
+//only the latest request is loaded, a newer request cancels one in flight between stages
+class RoomLoader{
+	public:
+		RoomLoader(const sm::Rom& rom, bool indexed): rom(rom), indexed(indexed), requested(0), started(0), delivered(0), quit(false), worker(&RoomLoader::run, this) {}
+		~RoomLoader(){
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				quit=true;
+			}
+			wake.notify_one();
+			worker.join();
+		}
+		//if standardState, loads the room's last state instead of state
+		void request(U16 index, int state, bool standardState, bool layer1, bool layer2){
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				next.index=index;
+				next.state=state;
+				next.standardState=standardState;
+				next.layer1=layer1;
+				next.layer2=layer2;
+				++requested;
+				result.reset();
+			}
+			wake.notify_one();
+		}
+		//true from a request until its result is taken
+		bool readLoading(){
+			std::lock_guard<std::mutex> lock(mutex);
+			return delivered!=requested;
+		}
+		//the latest request's result once it's done, otherwise NULL
+		std::unique_ptr<LoadedRoom> take(){
+			std::lock_guard<std::mutex> lock(mutex);
+			if(result) delivered=requested;
+			return std::move(result);
+		}
+	private:
+		struct Request{
+			U16 index;
+			int state;
+			bool standardState, layer1, layer2;
+		};
+		void run(){
+			std::unique_lock<std::mutex> lock(mutex);
+			while(true){
+				while(!quit&&started==requested) wake.wait(lock);
+				if(quit) return;
+				Request request=next;
+				unsigned generation=started=requested;
+				lock.unlock();
+				std::unique_ptr<LoadedRoom> loaded=load(request, generation);
+				lock.lock();
+				if(loaded&&generation==requested) result=std::move(loaded);
+			}
+		}
+		bool cancelled(unsigned generation){
+			std::lock_guard<std::mutex> lock(mutex);
+			return quit||generation!=requested;
+		}
+		//NULL if cancelled
+		std::unique_ptr<LoadedRoom> load(const Request& request, unsigned generation){
+			std::unique_ptr<LoadedRoom> loaded(new LoadedRoom(rom));
+			sm::Room& room=loaded->room;
+			LoadTimes& times=loaded->times;
+			sf::Clock clock;
+			loaded->index=request.index;
+			if(!room.open(rom.rooms.readOffset(request.index))) return loaded;
+			loaded->opened=true;
+			int state=request.state;
+			if(request.standardState||state>=(int)room.readStates()) state=room.readStates()-1;
+			room.setState(state);
+			loaded->state=state;
+			times.open=clock.restart().asSeconds();
+			if(cancelled(generation)) return std::unique_ptr<LoadedRoom>();
+			room.loadGraphics();
+			times.graphics=clock.restart().asSeconds();
+			if(cancelled(generation)) return std::unique_ptr<LoadedRoom>();
+			Array2D<Color> buffer;
+			if(indexed){
+				Array2D<U8> indices;
+				room.drawIndexedTileSet(indices, TILES_WIDE);
+				toIndexImage(indices, loaded->tiles);
+				toPaletteImage(room.readPalette(), loaded->palette);
+			}
+			else{
+				room.drawTileSet(buffer, TILES_WIDE);
+				toImage(buffer, loaded->tiles);
+			}
+			if(room.readMode7().readTiles().size()){
+				room.drawMode7(buffer);
+				toImage(buffer, loaded->mode7);
+			}
+			times.atlas=clock.restart().asSeconds();
+			if(cancelled(generation)) return std::unique_ptr<LoadedRoom>();
+			loaded->layer1=request.layer1;
+			loaded->layer2=request.layer2;
+			updateTiles(room, loaded->level, request.layer1, request.layer2);
+			times.geometry=clock.restart().asSeconds();
+			return loaded;
+		}
+		const sm::Rom& rom;
+		bool indexed;
+		std::mutex mutex;
+		std::condition_variable wake;
+		Request next;
+		unsigned requested, started, delivered;//generations, each request is a new one
+		bool quit;
+		std::unique_ptr<LoadedRoom> result;
+		std::thread worker;//last so everything it uses is constructed first
+};
+
+//the part of the room the window shows, centered on x, y
+sf::View worldView(float x, float y, float w, float h, float zoom){
+	return sf::View(sf::FloatRect(
+		sf::Vector2f(x-w*zoom/2, y-h*zoom/2),
+		sf::Vector2f(w*zoom, h*zoom)
+	));
+}
+
+//uploads a loaded room's images and takes its room and geometry
+void showRoom(LoadedRoom& loaded, sm::Room& room, int& state, sf::Texture& tilesTexture, sf::Texture& paletteTexture, sf::VertexArray& level, sf::Texture& mode7Texture, sf::VertexArray& mode7Quad, float& x, float& y, bool layer1, bool layer2, bool tileSet){
+	std::swap(room, loaded.room);
+	state=loaded.state;
+	tilesTexture.loadFromImage(loaded.tiles);
+	if(loaded.palette.getSize().x) paletteTexture.loadFromImage(loaded.palette);//palette swaps need only redo this
+	mode7Quad.clear();
+	if(loaded.mode7.getSize().x){
+		mode7Texture.loadFromImage(loaded.mode7);
+		drawTexture(mode7Texture, mode7Quad);
+	}
+	if(tileSet) drawTexture(tilesTexture, level);
+	else if(loaded.layer1!=layer1||loaded.layer2!=layer2) updateTiles(room, level, layer1, layer2);//toggled while loading
+	else level=loaded.level;
 	x=room.readW()/2;
 	y=room.readH()/2;
-	if(standardState) state=room.readStates()-1;
-	else if(state>=(int)room.readStates()) state=room.readStates()-1;
 }
 
 int main(int argc, char **argv){
@@ -84,6 +261,7 @@ int main(int argc, char **argv){
 	std::cerr.rdbuf(err.rdbuf());
 	//sfml
 	sf::RenderWindow window(sf::VideoMode(640, 480, 32), "super metroid viewer");
+	window.setVerticalSyncEnabled(true);
 	sf::Text text;
 	text.setColor(sf::Color(255, 0, 0, 255));
 	text.setScale(0.5f, 0.5f);
@@ -95,25 +273,37 @@ int main(int argc, char **argv){
 	//state initialization
 	U16 index=0;
 	int state;
-	sf::Texture tilesTexture;
-	sf::VertexArray level;
-	float x, y, w=window.getSize().x, h=window.getSize().y, zoom=2.0f;
+	sf::Texture tilesTexture, paletteTexture, mode7Texture;
+	sf::Shader paletteShader;
+	bool indexed=sf::Shader::isAvailable()&&paletteShader.loadFromMemory(PALETTE_SHADER, sf::Shader::Fragment);
+	if(indexed){
+		paletteShader.setParameter("indices", sf::Shader::CurrentTexture);
+		paletteShader.setParameter("palette", paletteTexture);
+	}
+	sf::VertexArray level, mode7Quad(sf::Quads);
+	float x=0.0f, y=0.0f, w=window.getSize().x, h=window.getSize().y, zoom=2.0f;
 	Tile tile;
 	int previousMouseX=0, previousMouseY=0;
 	bool dragging=false, layer1=true, layer2=true, mode7=true, tileSet=false;
-	setupRoom(room, index, state, tilesTexture, level, x, y, layer1, layer2, mode7, true);
+	bool redraw=true;//only draw when something has changed, otherwise wait for events
+	LoadTimes loadTimes;
+	sf::Clock frameClock;
+	float frameTime=0.0f;
+	RoomLoader loader(rom, indexed);
+	loader.request(index, 0, true, layer1, layer2);
+	bool shown=false;//nothing to show until the first room loads
+	U16 shownIndex=index;
+	std::string error;//why the latest room requested isn't the one shown
 	//loop
 	while(true){
 		//handle events
-		window.setView(sf::View(sf::FloatRect(
-			sf::Vector2f(x-w*zoom/2, y-h*zoom/2),
-			sf::Vector2f(w*zoom, h*zoom)
-		)));
 		sf::Event sfEvent;
-		while(window.pollEvent(sfEvent)){
+		bool loading=loader.readLoading();//can't wait for events while loading, the result isn't one
+		for(bool more=redraw||loading?window.pollEvent(sfEvent):window.waitEvent(sfEvent); more; more=window.pollEvent(sfEvent)){
 			switch(sfEvent.type){
 				case sf::Event::MouseMoved:
 					if(dragging){
+						redraw=true;
 						x-=zoom*(sfEvent.mouseMove.x-previousMouseX);
 						y-=zoom*(sfEvent.mouseMove.y-previousMouseY);
 						previousMouseX=sfEvent.mouseMove.x;
@@ -121,6 +311,7 @@ int main(int argc, char **argv){
 					}
 					break;
 				case sf::Event::MouseWheelMoved:
+					redraw=true;
 					if(sfEvent.mouseWheel.delta>0) zoom/=sfEvent.mouseWheel.delta*ZOOM_SPEED;
 					else zoom*=-sfEvent.mouseWheel.delta*ZOOM_SPEED;
 					if(zoom>MAX_ZOOM) zoom=MAX_ZOOM;
@@ -134,13 +325,12 @@ int main(int argc, char **argv){
 					}
 					else if(sfEvent.mouseButton.button==sf::Mouse::Right){
 						sf::Vector2f viewPosition;
-						viewPosition=window.convertCoords(sf::Vector2i(sfEvent.mouseButton.x, sfEvent.mouseButton.y));
+						viewPosition=window.convertCoords(sf::Vector2i(sfEvent.mouseButton.x, sfEvent.mouseButton.y), worldView(x, y, w, h, zoom));
 						sm::Transition door(rom);
-						if(room.readDoor(viewPosition.x, viewPosition.y, door)&&door.room){
-							for(index=0; index<sm::VANILLA_ROOMS; ++index)
-								if(sm::VANILLA_ROOM_OFFSETS[index]==door.room)
-									break;
-							setupRoom(room, index, state, tilesTexture, level, x, y, layer1, layer2, mode7, true);
+						if(shown&&room.readDoor(viewPosition.x, viewPosition.y, door)&&rom.rooms.find(door.room)!=sm::RoomRegistry::NONE){
+							redraw=true;
+							index=rom.rooms.find(door.room);
+							loader.request(index, state, true, layer1, layer2);
 						}
 					}
 					break;
@@ -148,55 +338,60 @@ int main(int argc, char **argv){
 					if(sfEvent.mouseButton.button==sf::Mouse::Left) dragging=false;
 					break;
 				case sf::Event::KeyPressed:
+					redraw=true;
 					switch(sfEvent.key.code){
 						case sf::Keyboard::Q: window.close(); break;
 						case sf::Keyboard::M: zoom=zoom>=MAX_ZOOM?MAX_ZOOM:zoom*ZOOM_SPEED; break;
 						case sf::Keyboard::N: zoom=zoom<=MIN_ZOOM?MIN_ZOOM:zoom/ZOOM_SPEED; break;
 						case sf::Keyboard::Space: x=room.readW()/2; y=room.readH()/2; break;
-						case sf::Keyboard::Num1: setupRoom(room, index=  0, state, tilesTexture, level, x, y, layer1, layer2, mode7, true); break;//crateria
-						case sf::Keyboard::Num2: setupRoom(room, index= 46, state, tilesTexture, level, x, y, layer1, layer2, mode7, true); break;//brinstar
-						case sf::Keyboard::Num3: setupRoom(room, index= 91, state, tilesTexture, level, x, y, layer1, layer2, mode7, true); break;//norfair
-						case sf::Keyboard::Num4: setupRoom(room, index=166, state, tilesTexture, level, x, y, layer1, layer2, mode7, true); break;//wrecked ship
-						case sf::Keyboard::Num5: setupRoom(room, index=200, state, tilesTexture, level, x, y, layer1, layer2, mode7, true); break;//maridia
-						case sf::Keyboard::Num6: setupRoom(room, index=237, state, tilesTexture, level, x, y, layer1, layer2, mode7, true); break;//tourian
-						case sf::Keyboard::Num7: setupRoom(room, index=256, state, tilesTexture, level, x, y, layer1, layer2, mode7, true); break;//ceres
-						case sf::Keyboard::Num8: setupRoom(room, index=262, state, tilesTexture, level, x, y, layer1, layer2, mode7, true); break;//debug
+						case sf::Keyboard::Num1: loader.request(index=  0, state, true, layer1, layer2); break;//crateria
+						case sf::Keyboard::Num2: loader.request(index= 46, state, true, layer1, layer2); break;//brinstar
+						case sf::Keyboard::Num3: loader.request(index= 91, state, true, layer1, layer2); break;//norfair
+						case sf::Keyboard::Num4: loader.request(index=166, state, true, layer1, layer2); break;//wrecked ship
+						case sf::Keyboard::Num5: loader.request(index=200, state, true, layer1, layer2); break;//maridia
+						case sf::Keyboard::Num6: loader.request(index=237, state, true, layer1, layer2); break;//tourian
+						case sf::Keyboard::Num7: loader.request(index=256, state, true, layer1, layer2); break;//ceres
+						case sf::Keyboard::Num8: loader.request(index=262, state, true, layer1, layer2); break;//debug
 						case sf::Keyboard::Numpad0:
 							tileSet=!tileSet;
 							if(tileSet) drawTexture(tilesTexture, level);
-							else updateTiles(room, level, layer1, layer2, mode7);
+							else updateTiles(room, level, layer1, layer2);
 							break;
-						case sf::Keyboard::Numpad1: layer1=!layer1; updateTiles(room, level, layer1, layer2, mode7); break;
-						case sf::Keyboard::Numpad2: layer2=!layer2; updateTiles(room, level, layer1, layer2, mode7); break;
-						case sf::Keyboard::Numpad3: mode7 =!mode7 ; updateTiles(room, level, layer1, layer2, mode7); break;
+						case sf::Keyboard::Numpad1: layer1=!layer1; updateTiles(room, level, layer1, layer2); break;
+						case sf::Keyboard::Numpad2: layer2=!layer2; updateTiles(room, level, layer1, layer2); break;
+						case sf::Keyboard::Numpad3: mode7 =!mode7 ; break;
 						case sf::Keyboard::Left:
 							if(index>0){
 								--index;
-								setupRoom(room, index, state, tilesTexture, level, x, y, layer1, layer2, mode7, true);
+								loader.request(index, state, true, layer1, layer2);
 							}
 							break;
 						case sf::Keyboard::Right:
-							if(index<sm::VANILLA_ROOMS-1){
+							if(index<rom.rooms.size()-1){
 								++index;
-								setupRoom(room, index, state, tilesTexture, level, x, y, layer1, layer2, mode7, true);
+								loader.request(index, state, true, layer1, layer2);
 							}
 							break;
 						case sf::Keyboard::Up:
 							if(state<(int)room.readStates()-1){
 								++state;
-								setupRoom(room, index, state, tilesTexture, level, x, y, layer1, layer2, mode7, false);
+								loader.request(index, state, false, layer1, layer2);
 							}
 							break;
 						case sf::Keyboard::Down:
 							if(state>0){
 								--state;
-								setupRoom(room, index, state, tilesTexture, level, x, y, layer1, layer2, mode7, false);
+								loader.request(index, state, false, layer1, layer2);
 							}
 							break;
 						default: break;
 					}
 					break;
+				case sf::Event::GainedFocus://the window may have been covered
+					redraw=true;
+					break;
 				case sf::Event::Resized:
+					redraw=true;
 					w=float(sfEvent.size.width);
 					h=float(sfEvent.size.height);
 					break;
@@ -208,19 +403,51 @@ int main(int argc, char **argv){
 		}
 		//draw
 		if(!window.isOpen()) break;
+		std::unique_ptr<LoadedRoom> loaded=loader.take();
+		if(loaded&&!loaded->opened){
+			std::cerr<<"couldn't open room "<<loaded->index<<"\n";
+			error="couldn't open room "+toString(loaded->index)+"\n";
+			redraw=true;
+		}
+		else if(loaded){
+			error="";
+			showRoom(*loaded, room, state, tilesTexture, paletteTexture, level, mode7Texture, mode7Quad, x, y, layer1, layer2, tileSet);
+			shownIndex=loaded->index;
+			loadTimes=loaded->times;
+			shown=true;
+			redraw=true;
+		}
+		if(!redraw){
+			if(loading) sf::sleep(sf::milliseconds(5));
+			continue;
+		}
+		redraw=false;
+		frameClock.restart();
+		window.setView(worldView(x, y, w, h, zoom));
 		window.clear();
-		window.draw(level, sf::RenderStates(&tilesTexture));
+		if(mode7&&!tileSet) window.draw(mode7Quad, sf::RenderStates(&mode7Texture));
+		sf::RenderStates tileStates(&tilesTexture);
+		if(indexed) tileStates.shader=&paletteShader;
+		window.draw(level, tileStates);
 		window.setView(sf::View(sf::FloatRect(
 			sf::Vector2f(0.0f, 0.0f),
 			sf::Vector2f(w, h)
 		)));
+		unsigned vertices=level.getVertexCount()+(mode7&&!tileSet?mode7Quad.getVertexCount():0);
 		std::string s;
-		s+="room: "+toString(index)+"."+toString(state)+"\n";
-		s+="state description: "+sm::Header::codeDescription(room.readStateCode(state))+"\n";
+		if(loader.readLoading()) s+="loading room "+toString(index)+"...\n";
+		s+=error;
+		if(shown){
+			s+="room: "+toString(shownIndex)+"."+toString(state)+"\n";
+			s+="state description: "+sm::Header::codeDescription(room.readStateCode(state))+"\n";
+		}
+		s+="frame: "+toString(frameTime*1000)+" ms, "+toString(vertices)+" vertices, "+(indexed?"indexed":"rgba")+" tiles\n";
+		s+="room load: open "+toString(loadTimes.open*1000)+" ms, loadGraphics "+toString(loadTimes.graphics*1000)+" ms, ";
+		s+="atlas "+toString(loadTimes.atlas*1000)+" ms, geometry "+toString(loadTimes.geometry*1000)+" ms\n";
 		text.setString(s);
 		window.draw(text);
+		frameTime=frameClock.getElapsedTime().asSeconds();//time to draw, not counting waiting for vsync
 		window.display();
-		sf::sleep(sf::seconds(1/60.0f));
 	}
 	//finish
 	std::cout<<std::flush;